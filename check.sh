@@ -0,0 +1,73 @@
+#!/bin/sh
+# Regression checks for the shell, run with make check.
+# usage: ./check.sh [path to shellax]
+
+SHELLAX=$(cd "$(dirname "${1:-./shellax}")" && pwd)/$(basename "${1:-./shellax}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+failed=0
+
+pass() { echo "ok   $1"; }
+fail() { echo "FAIL $1"; failed=1; }
+
+# expect name expected-output shellax-script
+expect() {
+    out=$("$SHELLAX" -c "$3" 2>&1)
+    if [ "$out" = "$2" ]; then pass "$1"; else fail "$1: got '$out'"; fi
+}
+
+printf 'a\na\nb\n' >in.txt
+
+# builtins forked as their own process apply <, > and 2> themselves
+expect "mycp with 2>" "ok" 'mycp in.txt cp.txt 2>err.txt && echo ok'
+cmp -s in.txt cp.txt && [ -s err.txt ] || fail "mycp with 2>: files"
+expect "redirect only" "ok" '> created.txt && echo ok'
+[ -f created.txt ] || fail "redirect only: created.txt missing"
+expect "uniq with < and >" "ok" 'set +o threads
+uniq -c < in.txt > uniq.txt && echo ok'
+[ "$(tr -s ' ' <uniq.txt)" = "$(printf ' 2 a\n 1 b')" ] || fail "uniq with < and >: output"
+expect "missing input" "-shellax: missing.txt: No such file or directory
+failed" 'set +o threads
+uniq < missing.txt || echo failed'
+
+# exit n in a script is the shell's exit status
+printf 'false\nexit 3\necho not reached\n' >exit.sh
+out=$("$SHELLAX" exit.sh 2>&1); status=$?
+if [ "$status" = 3 ] && [ -z "$out" ]; then pass "exit 3"; else fail "exit 3: status $status, '$out'"; fi
+
+# with $PATH unset lookups are still remembered
+out=$(env -u PATH "$SHELLAX" -c 'true
+true
+hash' 2>&1 | awk '/true$/ {print $1}')
+if [ "$out" = 2 ]; then pass "hash without PATH"; else fail "hash without PATH: hits '$out'"; fi
+
+# a backgrounded pipeline must leave the terminal with the interactive shell
+if command -v script >/dev/null 2>&1; then
+    out=$( (sleep 0.5; echo 'sleep 1 | cat &'; sleep 0.5; echo 'echo alive'
+            sleep 0.3; echo exit) | script -qec "$SHELLAX" /dev/null 2>&1 | tr -d '\r')
+    if echo "$out" | grep -q '^alive'; then pass "background pipeline"
+    else fail "background pipeline: the shell lost the terminal"; fi
+    # a history file past the cap is cut back to the newest lines
+    seq 1 60000 | sed 's/^/echo /' >.shellax_history
+    (sleep 0.3; echo exit) | HOME=$DIR script -qec "$SHELLAX" /dev/null >/dev/null 2>&1
+    if [ "$(head -1 .shellax_history)" = "echo 10001" ]; then pass "history trimmed"
+    else fail "history trimmed: $(wc -l <.shellax_history) lines"; fi
+else
+    echo "skip background pipeline and history: script(1) not found"
+fi
+
+# the last member to leave a shared memory room unlinks its ring
+room=check-$$
+(sleep 0.3; echo exit) | "$SHELLAX" -c "chatroom -s $room a" >/dev/null &
+(sleep 0.6; echo exit) | "$SHELLAX" -c "chatroom -s $room b" >/dev/null
+wait
+rm -rf "/tmp/chatroom-$room"
+if [ -e "/dev/shm/chatroom-$room" ]; then
+    fail "chatroom ring left in /dev/shm"
+    rm -f "/dev/shm/chatroom-$room"
+else
+    pass "chatroom ring unlinked"
+fi
+
+exit $failed
@@ -1,18 +1,34 @@
+#include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/pid.h>
+#include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/timekeeping.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "mymodule.h"
 
 // Meta Information
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("ME");
-MODULE_DESCRIPTION("A module that knows how to greet");
+MODULE_DESCRIPTION("Process tree inspector, sampler and query device for shellax");
+
+#define PSVIS_PROC_NAME "psvis"
 
-char *name;
-int age;
+int root_pid = 1;
 
 /*
  * module_param(foo, int, 0000)
@@ -22,26 +38,466 @@ int age;
  * for exposing parameters in sysfs (if non-zero) at a later stage.
  */
 
-module_param(name, charp, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-MODULE_PARM_DESC(name, "name of the caller");
+module_param(root_pid, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(root_pid, "root of the tree shown in /proc/psvis until a "
+                           "reader writes its own pid to the open file");
+
+int sample_ms = 1000;
+module_param(sample_ms, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(sample_ms, "interval of the sampler behind /dev/psvis, "
+                            "0 turns it off");
+
+int sample_records = 65536;
+module_param(sample_records, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(sample_records, "size of the sampler ring in records");
+
+// sampler ring: a header page, then the records, mapped by user space.
+// Where to write is only kept here, the header is published, never read.
+static void *ring;
+static size_t ring_size;
+static struct psvis_sample *ring_records;
+static u32 ring_capacity;
+static u64 ring_head, ring_pass;
+static void psvis_sample_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(sample_work, psvis_sample_work);
+
+// the tree as it was when /proc/psvis was opened
+struct psvis_snapshot {
+  size_t count;
+  struct psvis_proc entries[];
+};
+
+// what one open /proc/psvis file shows, kept in its seq_file->private
+struct psvis_file {
+  int root;                    // pid written to this file, root_pid at open
+  struct psvis_snapshot *snap; // taken on the first read after open or write
+};
+
+// cputime of a whole thread group, threads that already exited are
+// accounted in signal
+static void psvis_cputime(struct task_struct *p, u64 *utime, u64 *stime) {
+  struct task_struct *t;
+
+  *utime = p->signal->utime;
+  *stime = p->signal->stime;
+  for_each_thread(p, t) {
+    *utime += t->utime;
+    *stime += t->stime;
+  }
+}
+
+static unsigned long psvis_rss(struct task_struct *p) {
+  unsigned long rss = 0;
+
+  // task_lock keeps the mm from going away, no reference to drop later
+  task_lock(p);
+  if (p->mm)
+    rss = get_mm_rss(p->mm);
+  task_unlock(p);
+  return rss;
+}
+
+static void psvis_fill(struct psvis_proc *e, struct task_struct *task,
+                       int depth) {
+  memset(e, 0, sizeof(*e));
+  e->pid = task_pid_nr(task);
+  e->ppid = task_pid_nr(rcu_dereference(task->real_parent));
+  e->depth = depth;
+  e->state = task_state_to_char(task);
+  e->start_ns = task->start_time;
+  psvis_cputime(task, &e->utime_ns, &e->stime_ns);
+  e->rss_pages = psvis_rss(task);
+  get_task_comm(e->comm, task);
+}
+
+/**
+ * Walk the tree below root depth first, without recursion: go down to the
+ * first child, else to the next sibling, else back up until an ancestor
+ * has one. RCU alone doesn't keep the children and sibling lists still,
+ * a task exiting or being reparented mid-walk could lead the climb out of
+ * the subtree, so the walk holds tasklist_lock and nothing may sleep.
+ * @param  root      [description]
+ * @param  entries   [description]
+ * @param  max       room in entries, the walk goes on counting past it
+ * @param  max_depth levels below root to visit, -1 for all
+ * @return           processes visited
+ */
+static size_t psvis_walk(struct task_struct *root, struct psvis_proc *entries,
+                         size_t max, int max_depth) {
+  struct task_struct *task = root;
+  size_t count = 0;
+  int depth = 0;
+
+  read_lock(&tasklist_lock);
+  while (1) {
+    if (count < max)
+      psvis_fill(&entries[count], task, depth);
+    count++;
+
+    if (!list_empty(&task->children) && depth != max_depth) {
+      task = list_first_entry(&task->children, struct task_struct, sibling);
+      depth++;
+      continue;
+    }
+    while (task != root) {
+      struct task_struct *parent = rcu_dereference(task->real_parent);
+      if (!list_is_last(&task->sibling, &parent->children)) {
+        task = list_next_entry(task, sibling);
+        break;
+      }
+      task = parent;
+      depth--;
+    }
+    if (task == root) {
+      read_unlock(&tasklist_lock);
+      return count;
+    }
+  }
+}
+
+/**
+ * Take a snapshot of the tree under pid. It starts with room for a
+ * guess and doubles it outside the RCU section until the tree fits.
+ * @param pid [description]
+ * @return the snapshot, or an ERR_PTR
+ */
+static struct psvis_snapshot *psvis_snapshot(int pid) {
+  size_t max = 1024;
+
+  while (1) {
+    struct psvis_snapshot *snap;
+    struct task_struct *root;
+
+    snap = kvmalloc(struct_size(snap, entries, max), GFP_KERNEL);
+    if (!snap)
+      return ERR_PTR(-ENOMEM);
+    snap->count = 0;
+
+    rcu_read_lock();
+    // looked up under RCU, so there is no pid or task reference to leak
+    root = pid_task(find_vpid(pid), PIDTYPE_PID);
+    if (root)
+      snap->count = psvis_walk(root, snap->entries, max, -1);
+    rcu_read_unlock();
+
+    if (!root) {
+      kvfree(snap);
+      return ERR_PTR(-ESRCH);
+    }
+    if (snap->count <= max)
+      return snap;
+    max = snap->count + snap->count / 4; // grown since, leave some room
+    kvfree(snap);
+  }
+}
+
+static void *psvis_start(struct seq_file *m, loff_t *pos) {
+  struct psvis_file *pf = m->private;
+
+  if (!pf->snap) {
+    struct psvis_snapshot *snap = psvis_snapshot(pf->root);
+
+    if (IS_ERR(snap))
+      return snap;
+    pf->snap = snap;
+  }
+  if (*pos == 0)
+    return SEQ_START_TOKEN;
+  return *pos <= pf->snap->count ? &pf->snap->entries[*pos - 1] : NULL;
+}
+
+static void *psvis_next(struct seq_file *m, void *v, loff_t *pos) {
+  struct psvis_snapshot *snap = ((struct psvis_file *)m->private)->snap;
+
+  ++*pos;
+  return *pos <= snap->count ? &snap->entries[*pos - 1] : NULL;
+}
+
+static void psvis_stop(struct seq_file *m, void *v) {}
+
+static int psvis_show(struct seq_file *m, void *v) {
+  struct psvis_proc *e = v;
+
+  if (v == SEQ_START_TOKEN) {
+    seq_puts(m, "# pid ppid depth state start_ns rss_kb comm\n");
+    return 0;
+  }
+  seq_printf(m, "%d %d %d %c %llu %llu %s\n", e->pid, e->ppid, e->depth,
+             e->state, e->start_ns, e->rss_pages << (PAGE_SHIFT - 10),
+             e->comm);
+  return 0;
+}
+
+static const struct seq_operations psvis_seq_ops = {
+    .start = psvis_start,
+    .next = psvis_next,
+    .stop = psvis_stop,
+    .show = psvis_show,
+};
+
+static int psvis_open(struct inode *inode, struct file *file) {
+  struct psvis_file *pf;
+
+  pf = __seq_open_private(file, &psvis_seq_ops, sizeof(*pf));
+  if (!pf)
+    return -ENOMEM;
+  pf->root = root_pid;
+  return 0;
+}
+
+static int psvis_release(struct inode *inode, struct file *file) {
+  struct psvis_file *pf = ((struct seq_file *)file->private_data)->private;
+
+  kvfree(pf->snap);
+  return seq_release_private(inode, file);
+}
+
+// writing a pid picks the root for the following reads of this file only,
+// other readers keep their own; seek to 0 to read again after a write
+static ssize_t psvis_write(struct file *file, const char __user *buf,
+                           size_t len, loff_t *pos) {
+  struct seq_file *m = file->private_data;
+  struct psvis_file *pf = m->private;
+  int pid, err;
+
+  err = kstrtoint_from_user(buf, len, 10, &pid);
+  if (err)
+    return err;
+  if (pid <= 0)
+    return -EINVAL;
+  mutex_lock(&m->lock); // seq_read holds it while it uses the snapshot
+  pf->root = pid;
+  kvfree(pf->snap);
+  pf->snap = NULL;
+  mutex_unlock(&m->lock);
+  return len;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops psvis_proc_ops = {
+    .proc_open = psvis_open,
+    .proc_read = seq_read,
+    .proc_write = psvis_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = psvis_release,
+};
+#else
+static const struct file_operations psvis_proc_ops = {
+    .owner = THIS_MODULE,
+    .open = psvis_open,
+    .read = seq_read,
+    .write = psvis_write,
+    .llseek = seq_lseek,
+    .release = psvis_release,
+};
+#endif
+
+static void psvis_sample_task(struct psvis_sample *rec, struct task_struct *p,
+                              u64 pass) {
+  rec->pass = pass;
+  psvis_cputime(p, &rec->utime_ns, &rec->stime_ns);
+  rec->pid = task_pid_nr(p);
+  rec->ppid = task_pid_nr(rcu_dereference(p->real_parent));
+  rec->state = task_state_to_char(p);
+  get_task_comm(rec->comm, p);
+  rec->rss_pages = psvis_rss(p);
+}
+
+/**
+ * One sampler pass: a record per process goes into the ring, then the
+ * header says where the pass starts. Records are written before the
+ * header is updated, readers check the pass number of what they copied.
+ * @param work [description]
+ */
+static void psvis_sample_work(struct work_struct *work) {
+  struct psvis_ring_header *hdr = ring;
+  struct task_struct *p;
+  u64 head = ring_head, start = head, pass = ring_pass + 1;
+  u64 now = ktime_get_ns();
+
+  rcu_read_lock();
+  for_each_process(p) {
+    psvis_sample_task(&ring_records[head % ring_capacity], p, pass);
+    head++;
+    if (head - start == ring_capacity)
+      break; // more processes than the ring holds
+  }
+  rcu_read_unlock();
+  ring_head = head;
+  ring_pass = pass;
+
+  smp_wmb(); // records before the header
+  WRITE_ONCE(hdr->pass_start, start);
+  WRITE_ONCE(hdr->pass_count, head - start);
+  WRITE_ONCE(hdr->pass_time_ns, now);
+  smp_wmb();
+  WRITE_ONCE(hdr->pass, pass);
+  smp_store_release(&hdr->head, head);
+
+  schedule_delayed_work(&sample_work, msecs_to_jiffies(sample_ms));
+}
+
+// the ring can only be mapped read-only, and mprotect can't change that
+static int psvis_mmap(struct file *file, struct vm_area_struct *vma) {
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_clear(vma, VM_MAYWRITE);
+#else
+  vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+  return remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+}
+
+/**
+ * PSVIS_IOC_QUERY: everything is copied in before and out after the RCU
+ * section, which only fills a kernel buffer, so one call answers for any
+ * number of processes
+ * @param  uquery [description]
+ * @return        0 or an errno
+ */
+static long psvis_query(struct psvis_query __user *uquery) {
+  struct psvis_query q;
+  struct psvis_proc *procs;
+  s32 *pids = NULL;
+  size_t count = 0;
+  long err = 0;
+  u32 i;
+
+  if (copy_from_user(&q, uquery, sizeof(q)))
+    return -EFAULT;
+  if (q.capacity > PSVIS_QUERY_MAX || q.npids > PSVIS_QUERY_MAX)
+    return -EINVAL;
+
+  procs = kvmalloc_array(max(q.capacity, 1U), sizeof(*procs), GFP_KERNEL);
+  if (!procs)
+    return -ENOMEM;
+  if (q.pids) {
+    pids = kvmalloc_array(max(q.npids, 1U), sizeof(*pids), GFP_KERNEL);
+    if (!pids) {
+      err = -ENOMEM;
+      goto out;
+    }
+    if (copy_from_user(pids, u64_to_user_ptr(q.pids),
+                       q.npids * sizeof(*pids))) {
+      err = -EFAULT;
+      goto out;
+    }
+  }
 
-module_param(age, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-MODULE_PARM_DESC(age, "age of the caller");
+  rcu_read_lock();
+  if (pids) {
+    // pids that don't exist are left out
+    for (i = 0; i < q.npids; i++) {
+      struct task_struct *p = pid_task(find_vpid(pids[i]), PIDTYPE_PID);
+      if (!p)
+        continue;
+      if (count < q.capacity)
+        psvis_fill(&procs[count], p, 0);
+      count++;
+    }
+  } else {
+    struct task_struct *root = pid_task(find_vpid(q.root), PIDTYPE_PID);
+    if (root)
+      count = psvis_walk(root, procs, q.capacity, q.depth);
+    else
+      err = -ESRCH;
+  }
+  rcu_read_unlock();
+  if (err)
+    goto out;
+
+  q.total = min_t(size_t, count, U32_MAX);
+  q.count = min_t(size_t, count, q.capacity);
+  if (copy_to_user(u64_to_user_ptr(q.procs), procs,
+                   q.count * sizeof(*procs)) ||
+      copy_to_user(uquery, &q, sizeof(q)))
+    err = -EFAULT;
+out:
+  kvfree(pids);
+  kvfree(procs);
+  return err;
+}
+
+static long psvis_ioctl(struct file *file, unsigned int cmd,
+                        unsigned long arg) {
+  switch (cmd) {
+  case PSVIS_IOC_QUERY:
+    return psvis_query((struct psvis_query __user *)arg);
+  }
+  return -ENOTTY;
+}
+
+static const struct file_operations psvis_dev_fops = {
+    .owner = THIS_MODULE,
+    .mmap = psvis_mmap,
+    .unlocked_ioctl = psvis_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+    .compat_ioctl = compat_ptr_ioctl, // same layout on both sides
+#endif
+};
+
+static struct miscdevice psvis_misc = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "psvis",
+    .fops = &psvis_dev_fops,
+    .mode = 0444,
+};
+
+static int psvis_ring_init(void) {
+  struct psvis_ring_header *hdr;
+
+  if (sample_records <= 0)
+    return -EINVAL;
+  ring_size = PAGE_SIZE + PAGE_ALIGN((size_t)sample_records *
+                                     sizeof(struct psvis_sample));
+  ring = vmalloc_user(ring_size); // zeroed and mappable
+  if (!ring)
+    return -ENOMEM;
+  hdr = ring;
+  ring_records = ring + PAGE_SIZE;
+  ring_capacity = sample_records;
+  hdr->magic = PSVIS_RING_MAGIC;
+  hdr->record_size = sizeof(struct psvis_sample);
+  hdr->capacity = ring_capacity;
+  hdr->interval_ms = sample_ms;
+  hdr->data_offset = PAGE_SIZE;
+  hdr->page_size = PAGE_SIZE;
+  return 0;
+}
 
 // A function that runs when the module is first loaded
 int simple_init(void) {
-  struct task_struct *ts;
-
-  ts = get_pid_task(find_get_pid(4), PIDTYPE_PID);
+  int err;
 
-  printk("Hello from the kernel, user: %s, age: %d\n", name, age);
-  printk("command: %s\n", ts->comm);
+  err = psvis_ring_init();
+  if (err)
+    return err;
+  err = misc_register(&psvis_misc);
+  if (err) {
+    vfree(ring);
+    return err;
+  }
+  // 0666: a written pid only changes what that one open file shows
+  if (!proc_create(PSVIS_PROC_NAME, 0666, NULL, &psvis_proc_ops)) {
+    misc_deregister(&psvis_misc);
+    vfree(ring);
+    return -ENOMEM;
+  }
+  if (sample_ms > 0)
+    schedule_delayed_work(&sample_work, 0);
+  printk(KERN_INFO "psvis: /proc/%s ready, root pid %d, sampling every %d ms\n",
+         PSVIS_PROC_NAME, root_pid, sample_ms);
   return 0;
 }
 
 // A function that runs when the module is removed
 void simple_exit(void) {
-  printk("Goodbye from the kernel, user: %s, age: %d\n", name, age);
+  cancel_delayed_work_sync(&sample_work);
+  remove_proc_entry(PSVIS_PROC_NAME, NULL);
+  misc_deregister(&psvis_misc);
+  vfree(ring);
+  printk(KERN_INFO "psvis: unloaded\n");
 }
 
 module_init(simple_init);
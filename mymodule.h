@@ -0,0 +1,81 @@
+/*
+ * Interface between mymodule and shellax, included by both.
+ */
+#ifndef MYMODULE_H
+#define MYMODULE_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define PSVIS_DEVICE "/dev/psvis"
+#define PSVIS_COMM_LEN 16
+
+/*
+ * Sampler ring, mapped read-only from PSVIS_DEVICE. Every pass over the
+ * processes writes one psvis_sample per process at head % capacity and
+ * then publishes where the pass starts. A reader copies the records of
+ * the newest pass and checks that their pass field still matches.
+ */
+#define PSVIS_RING_MAGIC 0x70737672
+
+struct psvis_sample {
+  __u64 pass;      // pass that wrote this record
+  __u64 utime_ns;  // whole thread group
+  __u64 stime_ns;
+  __u64 rss_pages;
+  __s32 pid;
+  __s32 ppid;
+  char state;
+  char pad[7];
+  char comm[PSVIS_COMM_LEN];
+};
+
+struct psvis_ring_header {
+  __u32 magic;
+  __u32 record_size;  // sizeof(struct psvis_sample)
+  __u32 capacity;     // records in the ring
+  __u32 interval_ms;
+  __u64 data_offset;  // where the records start in the mapping
+  __u64 page_size;
+  __u64 head;         // records ever written
+  __u64 pass;         // last complete pass, 0 before the first
+  __u64 pass_start;   // its first record, as a head value
+  __u64 pass_count;
+  __u64 pass_time_ns; // CLOCK_MONOTONIC when it started
+};
+
+/*
+ * Batched lookup: PSVIS_IOC_QUERY fills procs with either the processes in
+ * pids, or the tree under root down to depth levels (-1 for all of it),
+ * in one call. total is how many matched, more than capacity means procs
+ * was too small and only the first capacity entries were filled.
+ */
+struct psvis_proc {
+  __s32 pid;
+  __s32 ppid;
+  __s32 depth;   // below root, 0 for pid lookups
+  char state;
+  char pad[3];
+  __u64 utime_ns;
+  __u64 stime_ns;
+  __u64 rss_pages;
+  __u64 start_ns; // since boot
+  char comm[PSVIS_COMM_LEN];
+};
+
+struct psvis_query {
+  __u64 pids;     // user pointer to __s32[npids], or 0 for a tree query
+  __u32 npids;
+  __s32 root;
+  __s32 depth;
+  __u32 capacity; // of procs
+  __u64 procs;    // user pointer to struct psvis_proc[capacity]
+  __u32 count;    // filled in
+  __u32 total;
+};
+
+#define PSVIS_IOC_MAGIC 'p'
+#define PSVIS_IOC_QUERY _IOWR(PSVIS_IOC_MAGIC, 1, struct psvis_query)
+#define PSVIS_QUERY_MAX (1 << 18)
+
+#endif
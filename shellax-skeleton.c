@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // copy_file_range, splice, fallocate
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -10,7 +11,34 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "mymodule.h"
 const char *sysname = "shellax";
+extern char **environ;
 #define MAX_STRING_LENGTH 256
 #define BUFF_SIZE 1000
 
@@ -21,23 +49,391 @@ enum return_codes {
   UNKNOWN = 2,
 };
 
+// how a pipeline is followed by the next one in a list
+enum list_ops {
+  LIST_END = 0, // last pipeline
+  LIST_SEQ,     // ; newline or &, always run the next one
+  LIST_AND,     // &&, run the next one if this one succeeded
+  LIST_OR,      // ||, run the next one if this one failed
+};
+
 struct command_t {
   char *name;
   bool background;
+  bool timed; // prefixed with the time keyword
   bool auto_complete;
   int arg_count;
   char **args;
-  char *redirects[3];     // in/out redirection
+  char *redirects[4];     // <, >, >> and 2> redirection
   struct command_t *next; // for piping
+  int list_op;            // set on the first command of a pipeline
+  struct command_t *list_next; // pipeline that follows in the list
+  struct arena *arena;    // everything above is allocated from it
+};
+
+// tokens produced by lex()
+enum token_types {
+  TOK_END,
+  TOK_WORD,
+  TOK_PIPE,    // |
+  TOK_AND,     // &&
+  TOK_OR,      // ||
+  TOK_AMP,     // &
+  TOK_SEMI,    // ; or newline
+  TOK_LESS,    // <
+  TOK_GREAT,   // >
+  TOK_DGREAT,  // >>
+  TOK_ERRGREAT,// 2>
+  TOK_ERROR,
+};
+
+// single pass over a command line, see lex()
+struct lexer {
+  const char *p;     // next input character
+  char *out;         // where the next word is unquoted to
+  char *word;        // text of the last TOK_WORD
+  const char *error; // set with TOK_ERROR
+};
+
+struct parser {
+  struct lexer lx;
+  int tok;           // current token
+  struct arena *arena;
+  char **words;      // scratch space for the words of one command
+  size_t words_cap;
+  bool failed;
+};
+
+
+// bash-style table of resolved command paths, see hash_lookup()
+#define HASH_BUCKETS 64
+struct hash_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct hash_entry *next;
+};
+struct hash_entry *command_hash[HASH_BUCKETS];
+char *hashed_path_env; // value of $PATH the table was filled against
+
+
+// job control: every pipeline is a job running in its own process group
+struct process {
+    pid_t pid;
+    char *name;
+    int status;     // as returned by waitpid
+    bool completed;
+    bool stopped;
+    double start;   // now_seconds() at launch and when reaped
+    double end;
+    struct rusage usage; // from wait4, valid once completed
+};
+struct job {
+    int id;         // the n in %n
+    pid_t pgid;
+    char *command;  // text shown by jobs/fg/bg
+    struct process *procs;
+    int nprocs;
+    bool background;
+    bool notified;  // a stop has been reported already
+    bool timed;     // print a per-stage resource report when it finishes
+    struct job *next;
+};
+struct job *job_list; // only changed with SIGCHLD blocked
+bool shell_interactive;
+pid_t shell_pgid;
+volatile sig_atomic_t wait_interrupted; // Ctrl+C while the wait builtin sleeps
+int last_status; // exit status of the last foreground job
+
+// options changed with the set builtin
+int opt_pipe_size; // F_SETPIPE_SZ for pipeline pipes, 0 keeps the kernel default
+bool opt_timing;   // report every job as if it was prefixed with time
+bool opt_threads = true; // pipelines of builtins run as threads, not processes
+
+
+// bump allocator, everything in it is released at once
+#define ARENA_BLOCK_SIZE (64 * 1024)
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+struct arena {
+    struct arena_block *head;
+};
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strndup(struct arena *a, const char *str, size_t len);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+// buffers and queues of builtin stages, reset after every pipeline but its
+// block is kept, so the next one doesn't allocate or fault in 64 KB chunks
+struct arena stage_arena;
+int parse_command(char *buf, struct command_t *command);
+
+
+// open-addressing line -> count table that remembers first-seen order
+// newlines found a 64 byte window at a time: one vector compare per
+// window, then one bit scan per line however short the lines are
+struct line_scanner {
+    const char *data;
+    size_t len;
+    size_t window; // offset of the window mask describes
+    uint64_t mask; // its newlines not returned yet
+};
+
+struct count_entry {
+    char *key; // interned in the table's arena
+    size_t len;
+    unsigned long hash;
+    long count;
+};
+struct count_table {
+    struct count_entry *entries; // in first-seen order
+    size_t used;
+    size_t capacity;
+    unsigned int *slots; // entry index + 1, 0 marks an empty slot
+    size_t nslots;       // power of two
+    struct arena keys;
+};
+
+
+// mycp splits files above this size into ranges copied by different workers
+#define MYCP_CHUNK_THRESHOLD (64L << 20)
+#define MYCP_CHUNK_SIZE (32L << 20)
+struct copy_file {
+    char *src;
+    char *dst;
+    off_t size;
+};
+struct copy_task {
+    size_t file; // index into copy_plan.files
+    off_t offset;
+    off_t len;
+};
+struct copy_plan {
+    struct copy_file *files;
+    size_t nfiles, files_cap;
+    struct copy_task *tasks;
+    size_t ntasks, tasks_cap;
+    size_t next;  // next task to hand out, taken atomically by the workers
+    off_t bytes;  // copied so far, updated atomically
+    int errors;
 };
 
 
-struct dictionary_t{
-    char* key;
-    int value;
-    struct dictionary_t *next;
+// buffered output for builtins that stream to a file descriptor
+#define OUTBUF_SIZE (64 * 1024)
+
+// pipe between two builtin stages running as threads of one process: a
+// single producer, single consumer ring of chunks. The writer waits while
+// every chunk is full and the reader while none is, on private futexes
+// that are only woken when the other side says it sleeps.
+#define STAGE_CHUNKS 8
+struct stage_queue {
+    uint32_t head;         // chunks published, stored by the writer only
+    uint32_t tail;         // chunks consumed, stored by the reader only
+    uint32_t writer_done;
+    uint32_t reader_done;  // nobody reads any more, like a broken pipe
+    uint32_t reader_wake;  // futex words, bumped on every change
+    uint32_t writer_wake;
+    uint32_t reader_waits;
+    uint32_t writer_waits;
+    size_t lens[STAGE_CHUNKS];
+    char data[STAGE_CHUNKS][OUTBUF_SIZE];
+};
+
+struct outbuf {
+    int fd;
+    struct stage_queue *queue; // written instead of fd when set
+    size_t len;
+    char data[OUTBUF_SIZE];
+};
+
+// what a builtin stage reads: a file descriptor or the stage before it
+struct stage_input {
+    int fd;
+    struct stage_queue *queue;
+    size_t offset; // already read from the chunk at queue->tail
+};
+
+
+// command history: a ring of the last HISTORY_MAX lines, appended to
+// ~/.shellax_history in batches and searched through a trigram index. The
+// file is cut back to HISTORY_MAX lines when a shell starts with more.
+#define HISTORY_MAX 50000
+#define HISTORY_BUCKETS (1 << 16)
+struct history {
+    char **lines;       // ring, entry seq lives in lines[seq % capacity]
+    uint32_t *lens;
+    size_t capacity;
+    size_t allocated;   // slots of lines and lens, grown up to capacity
+    size_t first, next; // seq of the oldest entry and one past the newest
+    char *map;          // history file as loaded, old lines point into it
+    size_t map_len;
+    int fd;             // history file opened with O_APPEND, -1 for none
+    char pending[4096]; // lines not written to the file yet
+    size_t pending_len;
+    uint32_t **postings; // per trigram bucket, ascending seqs
+    uint32_t *post_len, *post_cap;
+    size_t indexed;      // entries below this seq are in postings
+};
+struct history shell_history;
+
+// keys decoded from escape sequences by editor_key()
+enum editor_keys {
+  KEY_UP = 256,
+  KEY_DOWN,
+  KEY_RIGHT,
+  KEY_LEFT,
+  KEY_HOME,
+  KEY_END,
+  KEY_DELETE,
+  KEY_WORD_LEFT,
+  KEY_WORD_RIGHT,
+};
+
+// line being edited and what the terminal currently shows of it, so that
+// a redraw only sends the part that changed
+#define EDITOR_LINE 4096
+struct editor {
+  char buf[EDITOR_LINE];
+  size_t len, cursor;
+  char shown[EDITOR_LINE];
+  size_t shown_len, shown_cursor;
+  char out[3 * EDITOR_LINE]; // pending terminal output, one write() per redraw
+  size_t out_len;
+  unsigned char in[256];     // raw input, read in blocks
+  size_t in_len, in_pos;
+};
+void history_init(struct history *h, const char *path, size_t capacity);
+void history_add(struct history *h, const char *line, size_t len, bool persist);
+void history_trim(struct history *h, const char *path);
+const char *history_get(struct history *h, size_t seq, size_t *len);
+long history_search(struct history *h, const char *query, size_t before);
+void history_flush(struct history *h);
+void history_free(struct history *h);
+int history_builtin(struct command_t *command);
+// directory listing read with getdents64, kept until the mtime changes
+struct dir_listing {
+  char *path;
+  struct timespec mtime;
+  char **names; // sorted, the byte before each name is its d_type
+  size_t count;
+  struct arena arena;   // the names
+  struct dir_listing *next;
+};
+
+// command names from $PATH and the builtins, first child / next sibling
+struct trie_node {
+  uint32_t child;   // 0 for none, the root is never a child
+  uint32_t sibling;
+  char c;
+  bool terminal;    // a name ends here
+};
+struct completer {
+  struct trie_node *nodes;
+  size_t nnodes, cap;
+  char *path_env;   // $PATH the trie was built from
+  struct timespec *mtimes; // of each $PATH directory at that time
+  size_t ndirs;
+  struct dir_listing *dirs;
+};
+struct completer shell_completer;
+
+// chatroom: every member owns a FIFO in /tmp/chatroom-<room>, senders
+// keep the other members' FIFOs open and follow joins and leaves with
+// inotify on the room directory
+#define CHAT_MESSAGE_MAX 1024 // below PIPE_BUF, so messages never interleave
+struct chat_member {
+  char *name;
+  int fd;
+};
+// shared memory transport: one ring per room at /dev/shm/chatroom-<room>,
+// a message is written once and every member reads it with its own cursor
+#define CHAT_RING_SIZE (1 << 20)
+#define CHAT_RING_MAGIC 0x63686174
+#define CHAT_RING_MEMBERS 256
+struct chat_ring {
+  uint32_t magic;       // stored last by whoever creates the ring
+  uint32_t size;        // of data, a power of two
+  pthread_mutex_t lock; // writers, joiners and leavers; process-shared and robust
+  uint32_t closed;      // the last member left and unlinked the ring
+  pid_t members[CHAT_RING_MEMBERS]; // 0 is a free slot
+  uint64_t head;        // bytes ever written, the newest record ends here
+  uint64_t tail;        // the oldest record not overwritten yet
+  uint64_t seq;         // sequence number of the next message
+  uint32_t futex;       // bumped by every message, readers sleep on it
+  uint32_t waiters;
+  char data[];
+};
+// a record in the ring, the message follows padded to 8 bytes
+struct chat_record {
+  uint32_t len;
+  uint32_t pad;
+  uint64_t seq;
+};
+struct chat_shm {
+  struct chat_ring *ring;
+  size_t map_len;
+  char name[256];    // /chatroom-<room>, unlinked by the last member
+  uint64_t cursor;   // our read position
+  uint64_t next_seq; // expected next, gaps are messages we were too slow for
+  uint64_t lost;
+};
+
+// persistent room history: /tmp/chatroom-<room>/.log holds segments named
+// by their first sequence number, each with a sparse index next to it
+#define CHAT_SEGMENT_MAX (4L << 20) // rotate after this many bytes
+#define CHAT_LOG_MAX (64L << 20)    // oldest segments go beyond this
+#define CHAT_INDEX_SPACING 4096     // bytes of records per index entry
+#define CHAT_SYNC_RECORDS 64        // fdatasync at least this often
+#define CHAT_LOG_MAGIC 0x6c6f6731
+// shared by every member through the mapped .log/head, changed under flock
+struct chat_log_state {
+  uint32_t magic;
+  uint32_t pad;
+  uint64_t next_seq;
+  uint64_t segment;      // first seq of the segment being appended to
+  uint64_t seg_size;
+  uint64_t last_indexed; // offset of the newest index entry, -1 for none
+};
+// record header in a segment, the message follows
+struct chat_log_record {
+  uint32_t len;
+  uint32_t pad;
+  uint64_t seq;
+  int64_t time; // CLOCK_REALTIME ns
+};
+struct chat_log_index {
+  uint64_t seq;
+  int64_t time;
+  uint64_t offset;
+};
+struct chat_log {
+  char dir[300];
+  int lock_fd;
+  struct chat_log_state *state;
+  uint64_t segment; // the one seg_fd and idx_fd are open on
+  int seg_fd, idx_fd;
+  int pending;      // records since the last fdatasync
+};
+
+struct chat_room {
+  char dir[256];
+  char self_path[512];
+  const char *self;      // our member name
+  int self_fd;           // our FIFO, opened read-write so it never hits EOF
+  int inotify_fd;
+  struct chat_member *members;
+  size_t nmembers, cap;
 };
 
+int history_isearch(struct history *h, struct editor *ed);
+void editor_complete(struct editor *ed, bool list);
+int bench_complete(const char *prefix);
+void editor_flush(struct editor *ed);
+
 
 /**
  * Prints a command struct
@@ -49,7 +445,7 @@ void print_command(struct command_t *command) {
   printf("\tIs Background: %s\n", command->background ? "yes" : "no");
   printf("\tNeeds Auto-complete: %s\n", command->auto_complete ? "yes" : "no");
   printf("\tRedirects:\n");
-  for (i = 0; i < 3; i++)
+  for (i = 0; i < 4; i++)
     printf("\t\t%d: %s\n", i,
            command->redirects[i] ? command->redirects[i] : "N/A");
   printf("\tArguments (%d):\n", command->arg_count);
@@ -59,27 +455,20 @@ void print_command(struct command_t *command) {
     printf("\tPiped to:\n");
     print_command(command->next);
   }
+  if (command->list_next) {
+    printf("\tFollowed by (%s):\n", command->list_op == LIST_AND ? "&&" :
+           command->list_op == LIST_OR ? "||" : ";");
+    print_command(command->list_next);
+  }
 }
 /**
- * Release allocated memory of a command
+ * Release allocated memory of a command. Everything the parser made lives
+ * in the command's arena, so this is a single reset.
  * @param  command [description]
  * @return         [description]
  */
 int free_command(struct command_t *command) {
-  if (command->arg_count) {
-    for (int i = 0; i < command->arg_count; ++i)
-      free(command->args[i]);
-    free(command->args);
-  }
-  for (int i = 0; i < 3; ++i)
-    if (command->redirects[i])
-      free(command->redirects[i]);
-  if (command->next) {
-    free_command(command->next);
-    command->next = NULL;
-  }
-  free(command->name);
-  free(command);
+  arena_reset(command->arena);
   return 0;
 }
 /**
@@ -93,137 +482,439 @@ int show_prompt() {
   printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
   return 0;
 }
+/**
+ * Read the next token. Words are unquoted into lx->out as they are read:
+ * '...' is literal, "..." honours \\ \" \$ and \`, a backslash outside
+ * quotes escapes the next character. Every input character is looked at
+ * once and nothing is copied into fixed-size buffers.
+ * @param  lx [description]
+ * @return    one of token_types
+ */
+int lex(struct lexer *lx) {
+  const char *p = lx->p;
+
+  while (*p == ' ' || *p == '\t')
+    p++;
+  if (*p == '#') // comment up to the end of the line, also skips #!
+    while (*p && *p != '\n')
+      p++;
+  lx->p = p + 1;
+  switch (*p) {
+  case 0:
+    lx->p = p;
+    return TOK_END;
+  case '\n':
+  case ';':
+    return TOK_SEMI;
+  case '|':
+    if (p[1] == '|') {
+      lx->p = p + 2;
+      return TOK_OR;
+    }
+    return TOK_PIPE;
+  case '&':
+    if (p[1] == '&') {
+      lx->p = p + 2;
+      return TOK_AND;
+    }
+    return TOK_AMP;
+  case '<':
+    return TOK_LESS;
+  case '>':
+    if (p[1] == '>') {
+      lx->p = p + 2;
+      return TOK_DGREAT;
+    }
+    return TOK_GREAT;
+  case '2':
+    if (p[1] == '>') {
+      lx->p = p + 2;
+      return TOK_ERRGREAT;
+    }
+    break;
+  }
+
+  char *w = lx->out;
+  lx->word = w;
+  while (*p && !strchr(" \t\n;|&<>", *p)) {
+    if (*p == '\\') {
+      if (p[1])
+        *w++ = p[1];
+      p += p[1] ? 2 : 1;
+    } else if (*p == '\'') {
+      const char *end = strchr(p + 1, '\'');
+      if (end == NULL) {
+        lx->error = "unexpected EOF while looking for matching `''";
+        return TOK_ERROR;
+      }
+      memcpy(w, p + 1, end - p - 1);
+      w += end - p - 1;
+      p = end + 1;
+    } else if (*p == '"') {
+      p++;
+      while (*p && *p != '"') {
+        if (*p == '\\' && p[1] && strchr("\\\"$`", p[1]))
+          p++;
+        *w++ = *p++;
+      }
+      if (*p == 0) {
+        lx->error = "unexpected EOF while looking for matching `\"'";
+        return TOK_ERROR;
+      }
+      p++;
+    } else {
+      *w++ = *p++;
+    }
+  }
+  *w++ = 0;
+  lx->out = w;
+  lx->p = p;
+  return TOK_WORD;
+}
+
+void parse_error(struct parser *ps) {
+  static const char *names[] = {"newline", "word", "|", "&&", "||", "&",
+                                ";", "<", ">", ">>", "2>"};
+  if (!ps->failed) {
+    if (ps->tok == TOK_ERROR)
+      printf("-%s: %s\n", sysname, ps->lx.error);
+    else
+      printf("-%s: syntax error near unexpected token `%s'\n", sysname,
+             names[ps->tok]);
+  }
+  ps->failed = true;
+}
+
+/**
+ * command := (word | redirection word)+
+ * @param  ps [description]
+ * @return    the command, NULL on a syntax error
+ */
+struct command_t *parse_simple(struct parser *ps) {
+  struct command_t *c = arena_alloc(ps->arena, sizeof(struct command_t));
+  memset(c, 0, sizeof(struct command_t));
+  c->arena = ps->arena;
+  size_t n = 0;
+  bool redirected = false;
+
+  while (1) {
+    if (ps->tok == TOK_WORD) {
+      if (n == ps->words_cap) {
+        ps->words_cap = ps->words_cap ? ps->words_cap * 2 : 16;
+        ps->words = realloc(ps->words, ps->words_cap * sizeof(char *));
+      }
+      ps->words[n++] = ps->lx.word;
+      ps->tok = lex(&ps->lx);
+      continue;
+    }
+    int index = ps->tok == TOK_LESS ? 0 : ps->tok == TOK_GREAT ? 1 :
+                ps->tok == TOK_DGREAT ? 2 : ps->tok == TOK_ERRGREAT ? 3 : -1;
+    if (index < 0)
+      break;
+    ps->tok = lex(&ps->lx);
+    if (ps->tok != TOK_WORD) {
+      parse_error(ps);
+      return NULL;
+    }
+    c->redirects[index] = ps->lx.word;
+    redirected = true;
+    ps->tok = lex(&ps->lx);
+  }
+  if (n == 0 && !redirected) {
+    parse_error(ps);
+    return NULL;
+  }
+
+  // args gets its exact size once the command is complete, a command of
+  // only redirections still gets an empty name in args[0]
+  c->args = arena_alloc(ps->arena, sizeof(char *) * (n > 0 ? n + 1 : 2));
+  memcpy(c->args, ps->words, sizeof(char *) * n);
+  c->args[n] = NULL;
+  c->name = n > 0 ? c->args[0] : "";
+  if (n == 0)
+    c->args[0] = c->name, c->args[1] = NULL;
+  // name, arguments and the terminating NULL, as before
+  c->arg_count = n + 1;
+  return c;
+}
+
+/**
+ * pipeline := command ('|' command)*
+ * @param  ps [description]
+ * @return    [description]
+ */
+struct command_t *parse_pipeline(struct parser *ps) {
+  struct command_t *head = parse_simple(ps);
+  struct command_t *c = head;
+
+  while (c != NULL && ps->tok == TOK_PIPE) {
+    do // a newline may follow |
+      ps->tok = lex(&ps->lx);
+    while (ps->tok == TOK_SEMI && ps->lx.p[-1] == '\n');
+    c->next = parse_simple(ps);
+    c = c->next;
+  }
+  return c ? head : NULL;
+}
+
+/**
+ * list := pipeline ((';' | '&' | '&&' | '||') pipeline)* [';' | '&']
+ * @param  ps [description]
+ * @return    [description]
+ */
+struct command_t *parse_list(struct parser *ps) {
+  struct command_t *head = parse_pipeline(ps);
+  struct command_t *c = head;
+
+  while (c != NULL) {
+    if (ps->tok == TOK_END)
+      break;
+    if (ps->tok == TOK_SEMI || ps->tok == TOK_AMP) {
+      c->background = ps->tok == TOK_AMP;
+      c->list_op = LIST_SEQ;
+      do // blank lines in between
+        ps->tok = lex(&ps->lx);
+      while (ps->tok == TOK_SEMI && ps->lx.p[-1] == '\n');
+      if (ps->tok == TOK_END) {
+        c->list_op = LIST_END;
+        break;
+      }
+    } else if (ps->tok == TOK_AND || ps->tok == TOK_OR) {
+      c->list_op = ps->tok == TOK_AND ? LIST_AND : LIST_OR;
+      do // a newline may follow && and ||
+        ps->tok = lex(&ps->lx);
+      while (ps->tok == TOK_SEMI && ps->lx.p[-1] == '\n');
+    } else {
+      parse_error(ps);
+      return NULL;
+    }
+    c->list_next = parse_pipeline(ps);
+    c = c->list_next;
+  }
+  return c ? head : NULL;
+}
+
 /**
  * Parse a command string into a command struct
  * @param  buf     [description]
  * @param  command [description]
- * @return         0
+ * @return         0, -1 on a syntax error (command is left empty)
  */
 int parse_command(char *buf, struct command_t *command) {
-  const char *splitters = " \t"; // split at whitespace
-  int index, len;
-  len = strlen(buf);
-  while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-  {
-    buf++;
+  static struct parser ps; // keeps its scratch space between lines
+  size_t len = strlen(buf);
+  struct arena *arena = command->arena;
+
+  ps.lx.p = buf;
+  // unquoted words never outgrow the input plus one NUL per word
+  ps.lx.out = arena_alloc(arena, 2 * len + 2);
+  ps.lx.error = NULL;
+  ps.arena = arena;
+  ps.failed = false;
+
+  do // leading blank lines
+    ps.tok = lex(&ps.lx);
+  while (ps.tok == TOK_SEMI && ps.lx.p[-1] == '\n');
+  struct command_t *head = NULL;
+  if (ps.tok != TOK_END)
+    head = parse_list(&ps);
+
+  while (len > 0 && strchr(" \t\n", buf[len - 1]) != NULL)
     len--;
-  }
-  while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-    buf[--len] = 0; // trim right whitespace
-
-  if (len > 0 && buf[len - 1] == '?') // auto-complete
-    command->auto_complete = true;
-  if (len > 0 && buf[len - 1] == '&') // background
-    command->background = true;
-
-  char *pch = strtok(buf, splitters);
-  if (pch == NULL) {
-    command->name = (char *)malloc(1);
-    command->name[0] = 0;
+  bool auto_complete = len > 0 && buf[len - 1] == '?';
+
+  memset(command, 0, sizeof(struct command_t));
+  command->arena = arena;
+  if (head == NULL) {
+    command->name = "";
+    command->args = arena_alloc(arena, sizeof(char *) * 2);
+    command->args[0] = command->name;
+    command->args[1] = NULL;
+    command->arg_count = 2;
   } else {
-    command->name = (char *)malloc(strlen(pch) + 1);
-    strcpy(command->name, pch);
+    *command = *head;
   }
+  command->auto_complete = auto_complete;
+  return ps.failed ? -1 : 0;
+}
 
-  command->args = (char **)malloc(sizeof(char *));
+void editor_puts(struct editor *ed, const char *data, size_t len) {
+  if (ed->out_len + len > sizeof(ed->out))
+    editor_flush(ed);
+  memcpy(ed->out + ed->out_len, data, len);
+  ed->out_len += len;
+}
 
-  int redirect_index;
-  int arg_index = 0;
-  char temp_buf[1024], *arg;
-  while (1) {
-    // tokenize input on splitters
-    pch = strtok(NULL, splitters);
-    if (!pch)
+void editor_flush(struct editor *ed) {
+  size_t done = 0;
+  while (done < ed->out_len) {
+    ssize_t n = write(STDOUT_FILENO, ed->out + done, ed->out_len - done);
+    if (n < 0 && errno != EINTR)
       break;
-    arg = temp_buf;
-    strcpy(arg, pch);
-    len = strlen(arg);
-
-    if (len == 0)
-      continue; // empty arg, go for next
-    while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-    {
-      arg++;
-      len--;
-    }
-    while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-      arg[--len] = 0; // trim right whitespace
-    if (len == 0)
-      continue; // empty arg, go for next
-
-    // piping to another command
-    if (strcmp(arg, "|") == 0) {
-      struct command_t *c = malloc(sizeof(struct command_t));
-      int l = strlen(pch);
-      pch[l] = splitters[0]; // restore strtok termination
-      index = 1;
-      while (pch[index] == ' ' || pch[index] == '\t')
-        index++; // skip whitespaces
-
-      parse_command(pch + index, c);
-      pch[l] = 0; // put back strtok termination
-      command->next = c;
-      continue;
-    }
+    if (n > 0)
+      done += n;
+  }
+  ed->out_len = 0;
+}
 
-    // background process
-    if (strcmp(arg, "&") == 0)
-      continue; // handled before
+void editor_move(struct editor *ed, size_t from, size_t to) {
+  char seq[32];
+  if (from == to)
+    return;
+  int n = snprintf(seq, sizeof(seq), "\033[%zu%c",
+                   from > to ? from - to : to - from, from > to ? 'D' : 'C');
+  editor_puts(ed, seq, n);
+}
 
-    // handle input redirection
-    redirect_index = -1;
-    if (arg[0] == '<')
-      redirect_index = 0;
-    if (arg[0] == '>') {
-      if (len > 1 && arg[1] == '>') {
-        redirect_index = 2;
-        arg++;
-        len--;
-      } else
-        redirect_index = 1;
-    }
-    if (redirect_index != -1) {
-      command->redirects[redirect_index] = malloc(len);
-      strcpy(command->redirects[redirect_index], arg + 1);
-      continue;
+/**
+ * Bring the terminal from what it shows to the current line: skip the
+ * common prefix, rewrite the rest, clear what is left over and put the
+ * cursor back, all in one write()
+ * @param ed [description]
+ */
+void editor_refresh(struct editor *ed) {
+  size_t common = 0;
+  while (common < ed->len && common < ed->shown_len &&
+         ed->buf[common] == ed->shown[common])
+    common++;
+
+  if (common < ed->len || common < ed->shown_len) {
+    editor_move(ed, ed->shown_cursor, common);
+    editor_puts(ed, ed->buf + common, ed->len - common);
+    if (ed->shown_len > ed->len)
+      editor_puts(ed, "\033[K", 3);
+    editor_move(ed, ed->len, ed->cursor);
+  } else {
+    editor_move(ed, ed->shown_cursor, ed->cursor);
+  }
+  memcpy(ed->shown, ed->buf, ed->len);
+  ed->shown_len = ed->len;
+  ed->shown_cursor = ed->cursor;
+  editor_flush(ed);
+}
+
+/**
+ * Next key from the terminal. Escape sequences are decoded by a small
+ * state machine: ESC [ params final, ESC O final and ESC letter.
+ * @param  ed [description]
+ * @return    a byte, one of editor_keys, -1 at end of input
+ */
+int editor_key(struct editor *ed) {
+  enum { GROUND, ESCAPE, CSI, SS3 } state = GROUND;
+  char params[16];
+  size_t nparams = 0;
+
+  while (1) {
+    if (ed->in_pos == ed->in_len) {
+      ssize_t n = read(STDIN_FILENO, ed->in, sizeof(ed->in));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      ed->in_len = n;
+      ed->in_pos = 0;
     }
+    unsigned char c = ed->in[ed->in_pos++];
 
-    // normal arguments
-    if (len > 2 &&
-        ((arg[0] == '"' && arg[len - 1] == '"') ||
-         (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-    {
-      arg[--len] = 0;
-      arg++;
+    switch (state) {
+    case GROUND:
+      if (c != 27)
+        return c;
+      state = ESCAPE;
+      break;
+    case ESCAPE:
+      if (c == '[') {
+        state = CSI;
+      } else if (c == 'O') {
+        state = SS3;
+      } else if (c == 'b' || c == 'f') { // alt+b, alt+f
+        return c == 'b' ? KEY_WORD_LEFT : KEY_WORD_RIGHT;
+      } else {
+        state = GROUND; // unknown, dropped
+      }
+      break;
+    case CSI:
+      if ((c >= '0' && c <= '9') || c == ';') {
+        if (nparams < sizeof(params) - 1)
+          params[nparams++] = c;
+        break;
+      }
+      params[nparams] = 0;
+      // ctrl or alt held: 1;5C and 1;3C
+      bool word = strcmp(params, "1;5") == 0 || strcmp(params, "1;3") == 0;
+      switch (c) {
+      case 'A': return KEY_UP;
+      case 'B': return KEY_DOWN;
+      case 'C': return word ? KEY_WORD_RIGHT : KEY_RIGHT;
+      case 'D': return word ? KEY_WORD_LEFT : KEY_LEFT;
+      case 'H': return KEY_HOME;
+      case 'F': return KEY_END;
+      case '~':
+        if (strcmp(params, "1") == 0 || strcmp(params, "7") == 0)
+          return KEY_HOME;
+        if (strcmp(params, "4") == 0 || strcmp(params, "8") == 0)
+          return KEY_END;
+        if (strcmp(params, "3") == 0)
+          return KEY_DELETE;
+      }
+      state = GROUND;
+      nparams = 0;
+      break;
+    case SS3:
+      switch (c) {
+      case 'A': return KEY_UP;
+      case 'B': return KEY_DOWN;
+      case 'C': return KEY_RIGHT;
+      case 'D': return KEY_LEFT;
+      case 'H': return KEY_HOME;
+      case 'F': return KEY_END;
+      }
+      state = GROUND;
+      break;
     }
-    command->args =
-        (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-    command->args[arg_index] = (char *)malloc(len + 1);
-    strcpy(command->args[arg_index++], arg);
   }
-  command->arg_count = arg_index;
+}
 
-  // increase args size by 2
-  command->args = (char **)realloc(command->args,
-                                   sizeof(char *) * (command->arg_count += 2));
+void editor_set(struct editor *ed, const char *line, size_t len) {
+  if (len > sizeof(ed->buf) - 2)
+    len = sizeof(ed->buf) - 2;
+  memcpy(ed->buf, line, len);
+  ed->len = ed->cursor = len;
+}
 
-  // shift everything forward by 1
-  for (int i = command->arg_count - 2; i > 0; --i)
-    command->args[i] = command->args[i - 1];
+void editor_insert(struct editor *ed, char c) {
+  if (ed->len >= sizeof(ed->buf) - 2)
+    return;
+  memmove(ed->buf + ed->cursor + 1, ed->buf + ed->cursor,
+          ed->len - ed->cursor);
+  ed->buf[ed->cursor++] = c;
+  ed->len++;
+}
 
-  // set args[0] as a copy of name
-  command->args[0] = strdup(command->name);
-  // set args[arg_count-1] (last) to NULL
-  command->args[command->arg_count - 1] = NULL;
+void editor_delete(struct editor *ed, size_t from, size_t to) {
+  memmove(ed->buf + from, ed->buf + to, ed->len - to);
+  ed->len -= to - from;
+  ed->cursor = from;
+}
 
-  return 0;
+size_t editor_word_left(struct editor *ed) {
+  size_t i = ed->cursor;
+  while (i > 0 && !isalnum((unsigned char)ed->buf[i - 1]))
+    i--;
+  while (i > 0 && isalnum((unsigned char)ed->buf[i - 1]))
+    i--;
+  return i;
 }
 
-void prompt_backspace() {
-  putchar(8);   // go back 1
-  putchar(' '); // write empty over
-  putchar(8);   // go back 1 again
+size_t editor_word_right(struct editor *ed) {
+  size_t i = ed->cursor;
+  while (i < ed->len && !isalnum((unsigned char)ed->buf[i]))
+    i++;
+  while (i < ed->len && isalnum((unsigned char)ed->buf[i]))
+    i++;
+  return i;
 }
+
 /**
  * Prompt a command from the user
  * @param  buf      [description]
@@ -231,10 +922,13 @@ void prompt_backspace() {
  * @return          [description]
  */
 int prompt(struct command_t *command) {
-  int index = 0;
-  char c;
-  char buf[4096];
-  static char oldbuf[4096];
+  static struct editor ed; // keeps unread input between lines
+  struct history *h = &shell_history;
+  size_t browse = h->next;   // history entry shown, h->next for the new line
+  char draft[EDITOR_LINE];   // the new line while browsing history
+  size_t draft_len = 0;
+  bool done = false;
+  bool tabbed = false; // last key was a tab
 
   // tcgetattr gets the parameters of the current terminal
   // STDIN_FILENO will tell tcgetattr that it should write the settings
@@ -243,71 +937,137 @@ int prompt(struct command_t *command) {
   tcgetattr(STDIN_FILENO, &backup_termios);
   new_termios = backup_termios;
   // ICANON normally takes care that one line at a time will be processed
-  // that means it will return if it sees a "\n" or an EOF or an EOL
+  // that means it will return if it sees a "\n" or an EOF or an EOL.
+  // ISIG is off too, Ctrl+C only drops the line being edited.
   new_termios.c_lflag &=
-      ~(ICANON |
-        ECHO); // Also disable automatic echo. We manually echo each char.
+      ~(ICANON | ECHO | ISIG); // We draw the line ourselves.
   // Those new settings will be set to STDIN
   // TCSANOW tells tcsetattr to change attributes immediately.
   tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
 
   show_prompt();
-  buf[0] = 0;
-  while (1) {
-    c = getchar();
-    // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+  fflush(stdout);
+  ed.len = ed.cursor = ed.shown_len = ed.shown_cursor = 0;
+  while (!done) {
+    int c = editor_key(&ed);
+    if (c != 9)
+      tabbed = false;
 
-    if (c == 9) // handle tab
-    {
-      buf[index++] = '?'; // autocomplete
+    switch (c) {
+    case -1: // end of input
+    case 4:  // Ctrl+D, deletes forward unless the line is empty
+      if (c == 4 && ed.len > 0) {
+        if (ed.cursor < ed.len)
+          editor_delete(&ed, ed.cursor, ed.cursor + 1);
+        break;
+      }
+      tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+      return EXIT;
+    case 3: // Ctrl+C
+      editor_puts(&ed, "^C\n", 3);
+      editor_flush(&ed);
+      show_prompt();
+      fflush(stdout);
+      ed.len = ed.cursor = ed.shown_len = ed.shown_cursor = 0;
+      browse = h->next;
+      break;
+    case 9: // tab, a second one in a row lists the candidates
+      editor_complete(&ed, tabbed);
+      tabbed = true;
+      break;
+    case '\r':
+    case '\n':
+      done = true;
+      break;
+    case 127: // backspace
+    case 8:
+      if (ed.cursor > 0)
+        editor_delete(&ed, ed.cursor - 1, ed.cursor);
+      break;
+    case KEY_DELETE:
+      if (ed.cursor < ed.len)
+        editor_delete(&ed, ed.cursor, ed.cursor + 1);
+      break;
+    case KEY_LEFT:
+    case 2: // Ctrl+B
+      if (ed.cursor > 0)
+        ed.cursor--;
+      break;
+    case KEY_RIGHT:
+    case 6: // Ctrl+F
+      if (ed.cursor < ed.len)
+        ed.cursor++;
+      break;
+    case KEY_HOME:
+    case 1: // Ctrl+A
+      ed.cursor = 0;
+      break;
+    case KEY_END:
+    case 5: // Ctrl+E
+      ed.cursor = ed.len;
+      break;
+    case KEY_WORD_LEFT:
+      ed.cursor = editor_word_left(&ed);
+      break;
+    case KEY_WORD_RIGHT:
+      ed.cursor = editor_word_right(&ed);
+      break;
+    case 23: { // Ctrl+W, back to the previous space
+      size_t i = ed.cursor;
+      while (i > 0 && ed.buf[i - 1] == ' ')
+        i--;
+      while (i > 0 && ed.buf[i - 1] != ' ')
+        i--;
+      editor_delete(&ed, i, ed.cursor);
       break;
     }
-
-    if (c == 127) // handle backspace
-    {
-      if (index > 0) {
-        prompt_backspace();
-        index--;
+    case 21: // Ctrl+U
+      editor_delete(&ed, 0, ed.cursor);
+      break;
+    case 11: // Ctrl+K
+      ed.len = ed.cursor;
+      break;
+    case 18: // Ctrl+R
+      done = history_isearch(h, &ed);
+      break;
+    case KEY_UP:
+    case KEY_DOWN: {
+      size_t len;
+      if (c == KEY_UP && browse > h->first) {
+        if (browse == h->next) {
+          memcpy(draft, ed.buf, ed.len);
+          draft_len = ed.len;
+        }
+        browse--;
+      } else if (c == KEY_DOWN && browse < h->next) {
+        browse++;
+      } else {
+        break;
       }
-      continue;
-    }
-
-    if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68) {
-      continue;
+      if (browse < h->next) {
+        const char *line = history_get(h, browse, &len);
+        editor_set(&ed, line, len);
+      } else
+        editor_set(&ed, draft, draft_len);
+      break;
     }
-
-    if (c == 65) // up arrow
-    {
-      while (index > 0) {
-        prompt_backspace();
-        index--;
-      }
-
-      char tmpbuf[4096];
-      printf("%s", oldbuf);
-      strcpy(tmpbuf, buf);
-      strcpy(buf, oldbuf);
-      strcpy(oldbuf, tmpbuf);
-      index += strlen(buf);
-      continue;
+    default:
+      if (c >= 32 && c < 256 && c != 127)
+        editor_insert(&ed, c);
     }
 
-    putchar(c); // echo the character
-    buf[index++] = c;
-    if (index >= sizeof(buf) - 1)
-      break;
-    if (c == '\n') // enter key
-      break;
-    if (c == 4) // Ctrl+D
-      return EXIT;
+    // a pasted block is drawn once, after all of it has been handled
+    if (done || ed.in_pos == ed.in_len)
+      editor_refresh(&ed);
   }
-  if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-    index--;
-  buf[index++] = '\0'; // null terminate string
+  editor_move(&ed, ed.cursor, ed.len);
+  editor_puts(&ed, "\n", 1);
+  editor_flush(&ed);
 
-  strcpy(oldbuf, buf);
+  ed.buf[ed.len] = '\0'; // null terminate string
+  history_add(h, ed.buf, ed.len, true);
 
-  parse_command(buf, command);
+  parse_command(ed.buf, command);
 
   // print_command(command); // DEBUG: uncomment for debugging
 
@@ -315,161 +1075,482 @@ int prompt(struct command_t *command) {
   tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
   return SUCCESS;
 }
+
+/**
+ * Incremental reverse search, Ctrl+R again steps to older matches, enter
+ * runs the match and any other key keeps it for editing
+ * @param  h  [description]
+ * @param  ed line being edited, replaced by the match
+ * @return    true if the line should run
+ */
+int history_isearch(struct history *h, struct editor *ed) {
+  char query[256], status[EDITOR_LINE + 300];
+  size_t qlen = 0;
+  long match = -1;
+  size_t len = 0;
+  const char *line = "";
+
+  query[0] = 0;
+  while (1) {
+    int n = snprintf(status, sizeof(status), "\r\033[K(reverse-i-search)`%s': %.*s",
+                     query, (int)len, line);
+    editor_puts(ed, status, n < (int)sizeof(status) ? n : (int)sizeof(status) - 1);
+    editor_move(ed, len, 0); // cursor on the match, like bash
+    editor_flush(ed);
+    int c = editor_key(ed);
+    if (c == 18 && qlen > 0) {
+      long older = history_search(h, query, match >= 0 ? (size_t)match : h->next);
+      if (older >= 0)
+        match = older;
+    } else if (c == 127 || c == 8) {
+      if (qlen > 0)
+        query[--qlen] = 0;
+      match = qlen > 0 ? history_search(h, query, h->next) : -1;
+    } else if (c >= 32 && c < 127) {
+      if (qlen < sizeof(query) - 1) {
+        query[qlen++] = c;
+        query[qlen] = 0;
+      }
+      // the current match is kept while it still contains the query
+      match = history_search(h, query, match >= 0 ? (size_t)match + 1 : h->next);
+    } else {
+      if (match >= 0 && c != 3 && c != 7) // Ctrl+C and Ctrl+G cancel
+        editor_set(ed, line, len);
+      editor_puts(ed, "\r\033[K", 4);
+      editor_flush(ed);
+      show_prompt();
+      fflush(stdout);
+      ed->shown_len = ed->shown_cursor = 0;
+      return c == '\n' || c == '\r';
+    }
+    len = 0;
+    line = "";
+    if (match >= 0)
+      line = history_get(h, (size_t)match, &len);
+  }
+}
 int process_command(struct command_t *command);
+int process_list(struct command_t *command);
 int redirect(struct command_t *command);
 int createpipe(struct command_t *command,int amount1);
 int amountpipes(struct command_t *command);
 int amountredirections(struct command_t *command);
 int execCommand(struct command_t *command);
-int getDictionaryItem(struct dictionary_t *dict,char* key);
-void deleteDictionaryItem(struct dictionary_t *dict,char* key);
-void addDictionaryItem(struct dictionary_t *dict,char* key,int value);
-void chat(char* roomname, char* username);
+unsigned long hash_string(const char *str);
+char *hash_lookup(char *name);
+void hash_remove(char *name);
+void hash_clear();
+int hash_builtin(struct command_t *command);
+bool is_builtin(char *name);
+int launch_command(struct command_t *command, int in, int out, int *fds, int nfds, pid_t pgid,
+                   bool background, pid_t *pid);
+void init_shell(bool interactive);
+int run_script(const char *buf, size_t len, struct command_t *command);
+int run_file(const char *path, struct command_t *command);
+void sigchld_handler(int sig);
+void sigint_wait_handler(int sig);
+struct job *job_create(struct command_t *command);
+void job_free(struct job *job);
+bool job_is_completed(struct job *job);
+bool job_is_stopped(struct job *job);
+int job_wait(struct job *job, sigset_t *mask);
+int job_foreground(struct job *job, bool cont, sigset_t *mask);
+void job_notify();
+struct job *job_find(char *spec);
+int jobs_builtin(struct command_t *command);
+int set_builtin(struct command_t *command);
+void job_report(struct job *job);
+int make_pipe(int fds[2]);
+int bench_pipe(int size_mb);
+double now_seconds();
+int bench_spawn(int count, int heap_mb);
+int bench_parse(int lines);
+int bench_history(int entries);
+int bench_pipeline(int size_mb, int max_stages);
+int bench_uniq(int size_mb);
+int bench_mycp(int size_mb);
+int bench_suite();
+int bench_builtin(struct command_t *command);
+void text_init();
+void line_scanner_init(struct line_scanner *s, const char *data, size_t len);
+const char *line_next(struct line_scanner *s);
+const char *script_statement_end(struct line_scanner *scan, const char *p, const char *end);
+size_t line_count(const char *data, size_t len);
+bool text_equal(const char *a, const char *b, size_t len);
+int bench_text(int size_mb);
+unsigned long hash_bytes(const char *data, size_t len);
+void count_table_init(struct count_table *t);
+long *count_table_add(struct count_table *t, const char *key, size_t len);
+void count_table_free(struct count_table *t);
+void chat(int arg_count, char **args);
+int chat_join(struct chat_room *room, const char *roomname, const char *username);
+void chat_leave(struct chat_room *room);
+void chat_refresh(struct chat_room *room);
+size_t chat_send(struct chat_room *room, const char *msg, size_t len);
+int bench_chat(int clients, int messages, bool shm);
+int chat_shm_open(struct chat_shm *r, const char *roomname);
+void chat_shm_publish(struct chat_shm *r, const char *msg, size_t len);
+ssize_t chat_shm_read(struct chat_shm *r, char *out, size_t cap, int timeout_ms);
+void chat_shm_close(struct chat_shm *r);
+int chat_log_open(struct chat_log *log, const char *roomname);
+int chat_log_append(struct chat_log *log, const char *msg, size_t len);
+void chat_log_sync(struct chat_log *log);
+void chat_log_close(struct chat_log *log);
+int chat_log_replay(struct chat_log *log, uint64_t last, int64_t since, int fd);
+int bench_chatlog(int messages);
 void palindrome(int arg_count,char** args);
-void uniq(char* words,char* param);
-void mycp(char *src, char *dst);
+int palindrome_stage(int arg_count, char **args, struct stage_input *in, struct outbuf *out);
+void uniq(int arg_count, char **args);
+int uniq_stage(int arg_count, char **args, struct stage_input *in, struct outbuf *out);
+void out_write(struct outbuf *o, const char *data, size_t len);
+void out_flush(struct outbuf *o);
+void stage_queue_init(struct stage_queue *q);
+ssize_t stage_queue_write(struct stage_queue *q, const char *data, size_t len);
+void stage_queue_close_writer(struct stage_queue *q);
+void stage_queue_close_reader(struct stage_queue *q);
+ssize_t stage_read(struct stage_input *in, char *buf, size_t cap);
+int stage_group(struct command_t *command, bool timed);
+bool stage_inline(struct command_t *command);
+int stage_pipeline(struct command_t *first, int count, int in, int out);
+int mycp(int arg_count, char **args);
+int parallel(int arg_count, char **args);
+int psvis(int arg_count, char **args);
+int pstop(int arg_count, char **args);
+int mycp_single(char *src, char *dst);
+off_t copy_data(int in, int out);
+off_t copy_range(int in, int out, off_t offset, off_t len);
+
+int main(int argc, char *argv[]) {
+  static struct arena command_arena;
+  static struct command_t command_storage;
+  struct command_t *command = &command_storage;
+  command->arena = &command_arena;
+  text_init();
+
+  // shellax -c 'cmd' and shellax script.sh never touch the terminal
+  if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+    init_shell(false);
+    run_script(argv[2], strlen(argv[2]), command);
+    return last_status;
+  }
+  if (argc == 2 && strcmp(argv[1], "-c") == 0) {
+    fprintf(stderr, "%s: -c: option requires an argument\n", sysname);
+    return 2;
+  }
+  if (argc > 1) {
+    init_shell(false);
+    if (run_file(argv[1], command) < 0)
+      return 127;
+    return last_status;
+  }
 
-int main() {
+  init_shell(true);
+  char *home = getenv("HOME");
+  if (home != NULL) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/.%s_history", home, sysname);
+    history_init(&shell_history, path, HISTORY_MAX);
+  }
   while (1) {
-    struct command_t *command = malloc(sizeof(struct command_t));
     memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+    command->arena = &command_arena;
 
+    job_notify(); // report background jobs that finished or stopped
     int code;
     code = prompt(command);
     if (code == EXIT)
       break;
 
-    code = process_command(command);
+    code = process_list(command);
     if (code == EXIT)
       break;
 
     free_command(command);
   }
 
+  history_flush(&shell_history);
   printf("\n");
-  return 0;
+  return last_status;
 }
 
-int process_command(struct command_t *command) {
-  int r;
+/**
+ * Where the statement starting at p ends: the first newline outside quotes
+ * that doesn't follow |, && or ||, after which the statement goes on. Only
+ * lines with quotes, backslashes or comments are looked at byte by byte.
+ * @param  scan newlines from p on
+ * @param  p    [description]
+ * @param  end  [description]
+ * @return      the newline, or end
+ */
+const char *script_statement_end(struct line_scanner *scan, const char *p,
+                                 const char *end) {
+  char quote = 0;
+  bool cont = false; // the last line ended in an operator
 
-  if (strcmp(command->name, "") == 0)
-    return SUCCESS;
+  while (1) {
+    const char *nl = line_next(scan);
+    const char *stop = nl ? nl : end;
+    size_t n = stop - p;
 
-  if (strcmp(command->name, "exit") == 0)
-    return EXIT;
+    if (quote == 0 && !memchr(p, '\'', n) && !memchr(p, '"', n) &&
+        !memchr(p, '\\', n) && !memchr(p, '#', n)) {
+      const char *q = stop;
+      while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+        q--;
+      if (q > p) // blank lines keep going
+        cont = q[-1] == '|' || (q[-1] == '&' && q - 1 > p && q[-2] == '&');
+    } else {
+      bool comment = false;
+      for (const char *q = p; q < stop; q++) {
+        if (quote) {
+          if (*q == quote)
+            quote = 0;
+          else if (*q == '\\' && quote == '"' && q + 1 < stop)
+            q++;
+          cont = false;
+        } else if (comment) {
+          continue;
+        } else if (*q == '\\') {
+          q++;
+          cont = false;
+        } else if (*q == '\'' || *q == '"') {
+          quote = *q;
+          cont = false;
+        } else if (*q == '#' && (q == p || strchr(" \t;|&<>", q[-1]))) {
+          comment = true;
+        } else if (*q != ' ' && *q != '\t') {
+          cont = *q == '|' || (*q == '&' && q > p && q[-1] == '&');
+        }
+      }
+    }
+    if (nl == NULL)
+      return end;
+    if (quote == 0 && !cont)
+      return nl;
+    p = nl + 1;
+  }
+}
 
-  if (strcmp(command->name, "cd") == 0) {
-    if (command->arg_count > 0) {
-      r = chdir(command->args[0]);
-      if (r == -1)
-        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-      return SUCCESS;
+/**
+ * Run a script a statement at a time: no prompt, no termios, only parse and exec
+ * @param  buf     script text, need not be NUL terminated
+ * @param  len     [description]
+ * @param  command [description]
+ * @return         EXIT if the script ran exit
+ */
+int run_script(const char *buf, size_t len, struct command_t *command) {
+  struct arena *arena = command->arena;
+  const char *p = buf, *end = buf + len;
+  char *line = NULL;
+  size_t cap = 0;
+  int code = SUCCESS;
+  struct line_scanner scan;
+
+  line_scanner_init(&scan, buf, len);
+  while (p < end && code != EXIT) {
+    // a statement can go on over several lines
+    size_t n = script_statement_end(&scan, p, end) - p;
+    if (n + 1 > cap) {
+      cap = n + 1 > 2 * cap ? n + 1 : 2 * cap;
+      line = realloc(line, cap);
     }
+    memcpy(line, p, n);
+    line[n] = 0;
+    p += n + 1;
+
+    memset(command, 0, sizeof(struct command_t));
+    command->arena = arena;
+    job_notify();
+    if (parse_command(line, command) == 0)
+      code = process_list(command);
+    else
+      last_status = 2;
+    free_command(command);
   }
-  pid_t pid = fork();
-  if (pid == 0) // child
-  {
-    /// This shows how to do exec with environ (but is not available on MacOs)
-    // extern char** environ; // environment variables
-    // execvpe(command->name, command->args, environ); // exec+args+path+environ
-
-    /// This shows how to do exec with auto-path resolve
-    // add a NULL argument to the end of args, and the name to the beginning
-    // as required by exec
-
-    // TODO: do your own exec with path resolving using execv()
-    // do so by replacing the execvp call below
-      
-    //REDIRECT
-    int amount= amountpipes(command);
-
-
-    char path[MAX_STRING_LENGTH];
-    sprintf(path,"/bin/%s",command->name);
-
-    int input_redirection=0,output_redirection=0;
-    int in,out;
-
-      if(strcmp(command->name,"mycp") == 0 ||
-         strcmp(command->name,"palindrome") == 0 ||
-          strcmp(command->name,"chatroom") == 0 || amount > 0){
-        createpipe(command,amount);
-      }
-      else if (execv(path, command->args) < 0) {
-          perror("Command not found!");
-          return -1;
-      }
-      else{
-          redirect(command);
-      }
+  free(line);
+  return code;
+}
+
+/**
+ * Run a script file. Regular files are mapped, anything else (a pipe,
+ * /dev/stdin) is read in large blocks.
+ * @param  path    [description]
+ * @param  command [description]
+ * @return         -1 if the file could not be read
+ */
+int run_file(const char *path, struct command_t *command) {
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
 
-    exit(0);
-      
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "%s: %s: %s\n", sysname, path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
   }
-  else {
-    // TODO: implement background processes here
-      waitpid(pid, 0, 0);   // wait for child process to finish
-    return SUCCESS;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      close(fd);
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      run_script(map, st.st_size, command);
+      munmap(map, st.st_size);
+      return 0;
+    }
   }
 
-  // TODO: your implementation here
-
-  printf("-%s: %s: command not found\n", sysname, command->name);
-  return UNKNOWN;
+  size_t len = 0, cap = 1 << 16;
+  char *buf = malloc(cap);
+  ssize_t n;
+  while ((n = read(fd, buf + len, cap - len)) > 0) {
+    len += n;
+    if (len == cap)
+      buf = realloc(buf, cap *= 2);
+  }
+  close(fd);
+  run_script(buf, len, command);
+  free(buf);
+  return 0;
 }
 
-int redirect(struct command_t *command)
-{
-    int amount= amountredirections(command);
-    
-    if(amount <= 0 ){
-        return 0;
-    }
-    
-    char* input_file, output_file;
-    int input_redirection=0,output_redirection=0;
-    
-    if(strcmp(command->redirects[1],"N/A")!=0 && strcmp(command->redirects[0],"N/A")!=0){
-        input_redirection=1;
-        output_redirection=1;
+/**
+ * Run every pipeline of a ; && || list, && and || look at the exit status
+ * of the last pipeline that actually ran
+ * @param  command first pipeline of the list
+ * @return         EXIT if one of them was exit
+ */
+int process_list(struct command_t *command) {
+  int op = LIST_SEQ;
+
+  for (struct command_t *c = command; c != NULL; c = c->list_next) {
+    if (!(op == LIST_AND && last_status != 0) &&
+        !(op == LIST_OR && last_status == 0)) {
+      if (process_command(c) == EXIT)
+        return EXIT;
     }
-    else if(strcmp(command->redirects[0],"N/A")!=0){
-        input_redirection=1;
+    op = c->list_op;
+  }
+  return SUCCESS;
+}
+
+int process_command(struct command_t *command) {
+  int r;
+
+  // "> file" still runs, to create or truncate the file
+  if (strcmp(command->name, "") == 0 && amountredirections(command) == 0 &&
+      command->next == NULL)
+    return SUCCESS;
+
+  if (strcmp(command->name, "exit") == 0) {
+    // exit [n], the shell's status is n or that of the last command
+    char *arg = command->args[1], *end;
+    if (arg != NULL) {
+      long n = strtol(arg, &end, 10);
+      if (end == arg || *end != 0) {
+        fprintf(stderr, "-%s: exit: %s: numeric argument required\n", sysname, arg);
+        n = 2;
+      }
+      last_status = n & 0xff;
     }
-    else if(strcmp(command->redirects[1],"N/A")!=0){
-        output_redirection=1;
+    return EXIT;
+  }
+
+  if (strcmp(command->name, "time") == 0 && command->args[1] != NULL) {
+    // drop the keyword, the rest runs as a timed job
+    command->args++;
+    command->arg_count--;
+    command->name = command->args[0];
+    command->timed = true;
+  }
+
+  if (strcmp(command->name, "cd") == 0) {
+    char *dir = command->args[1] ? command->args[1] : getenv("HOME");
+    r = dir ? chdir(dir) : -1;
+    if (r == -1)
+      printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+    last_status = r == -1 ? 1 : 0;
+    return SUCCESS;
+  }
+  if (strcmp(command->name, "hash") == 0)
+    return hash_builtin(command);
+
+  if (strcmp(command->name, "bench") == 0)
+    return bench_builtin(command);
+
+  if (strcmp(command->name, "set") == 0)
+    return set_builtin(command);
+
+  if (strcmp(command->name, "history") == 0)
+    return history_builtin(command);
+
+  if (strcmp(command->name, "jobs") == 0 || strcmp(command->name, "fg") == 0 ||
+      strcmp(command->name, "bg") == 0 || strcmp(command->name, "wait") == 0)
+    return jobs_builtin(command);
+
+  // every pipeline, even a single command, runs as a job. Its stages are
+  // launched from here so paths they resolve stay in this process' hash table
+  int amount = amountpipes(command);
+  last_status = createpipe(command, amount);
+  return SUCCESS;
+}
+
+/**
+ * Apply a command's <, >, >> and 2> redirections to this process
+ * @param  command [description]
+ * @return         0 on success, -1 if a file could not be opened
+ */
+int redirect(struct command_t *command)
+{
+    int amount= amountredirections(command);
+    
+    if(amount <= 0 ){
+        return 0;
     }
     
-
-    if(output_redirection==1){
-        int out= creat(command->redirects[1],0644);
+    if(command->redirects[1] != NULL || command->redirects[2] != NULL){
+        int out;
+        char *file;
+        if(command->redirects[1] != NULL){
+            file = command->redirects[1];
+            out= open(file,O_WRONLY|O_CREAT|O_TRUNC,0644);
+        }
+        else{
+            file = command->redirects[2];
+            out= open(file,O_WRONLY|O_CREAT|O_APPEND,0644);
+        }
         if(out<0){
-            fprintf(stderr, "Failed writing on %d\n", out);
-            return(EXIT_FAILURE);
+            fprintf(stderr, "-%s: %s: %s\n", sysname, file, strerror(errno));
+            return -1;
         }
         if(dup2(out, 1) < 0){
-            printf("Unable to write the file.");
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "Unable to write the file.\n");
+            return -1;
         }
         close(out);
-        output_redirection=0;
     }
     
-    if(input_redirection==1){
-        int in= creat(command->redirects[1],0644);
+    if(command->redirects[3] != NULL){
+        int err= open(command->redirects[3],O_WRONLY|O_CREAT|O_TRUNC,0644);
+        if(err<0 || dup2(err, 2) < 0){
+            fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[3], strerror(errno));
+            return -1;
+        }
+        close(err);
+    }
+    
+    if(command->redirects[0] != NULL){
+        int in= open(command->redirects[0],O_RDONLY);
         if(in<0){
-            fprintf(stderr, "Failed reading on %d\n", in);
-            return(EXIT_FAILURE);
+            fprintf(stderr, "-%s: %s: %s\n", sysname, command->redirects[0], strerror(errno));
+            return -1;
         }
         if(dup2(in, 0) < 0){
-            printf("Unable to read the file.");
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "Unable to read the file.\n");
+            return -1;
         }
         close(in);
-        input_redirection=0;
     }
-    return 1;
+    return 0;
 }
 
 
@@ -480,26 +1561,74 @@ int createpipe(struct command_t *command,int amount1)
     int amount = amount1;
     int pipecount= amount*2;
     int wr[amount*2];
-    int fd;
-    char buffer[100];
-    char msg[100];
+    sigset_t mask, oldmask;
 
     struct command_t *c= command;
     pid_t pid;
+
+    // builtins only: threads of the shell itself, no fork and no pipes
+    if(stage_inline(command)){
+        fflush(stdout);
+        return stage_pipeline(command, amount + 1, STDIN_FILENO, STDOUT_FILENO);
+    }
             
     //CREATING ALL PIPES
     for(i = 0; i < (amount); i++){
-        if(pipe(wr + i*2) < 0) {
+        if(make_pipe(wr + i*2) < 0) {
             perror("Error occured during piping");
             exit(1);
         }
     }
+
+    fflush(stdout); // don't let a child flush our pending prompt again
+
+    // a stage that exits right away must not be reaped before it is in
+    // the job table, so SIGCHLD stays blocked until the job is complete
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    struct job *job = job_create(command);
+    job->background = command->background;
+    job->timed = command->timed || opt_timing;
+
     // CHECKING ALL PIPES DURING LOOP
     while(c != NULL) {
-        pid = fork();
+        double start = now_seconds();
+        // builtins next to each other share one process as threads
+        int group = stage_group(c, command->timed);
+        struct command_t *last = c;
+        for(i = 1; i < group; i++){
+            last = last->next;
+        }
+        int out_index = index + 2 * (group - 1);
+        if(group == 1 && !is_builtin(c->name)){
+            // external stages are spawned without copying our address space
+            int in = index != 0 ? wr[index-2] : STDIN_FILENO;
+            int out = c->next ? wr[index+1] : STDOUT_FILENO;
+            // the pipes are close-on-exec, nothing else to close in the child
+            if(launch_command(c, in, out, NULL, 0, job->pgid, job->background, &pid) != 0){
+                fprintf(stderr, "-%s: %s: command not found\n", sysname, c->name);
+                pid = -2; // nothing started, not the child either
+            }
+        }
+        else{
+            pid = fork();
+        }
         if(pid == 0) {
-            if(c->next){
-                int fdr1 = dup2(wr[index + 1], 1);
+            // builtin stage, set up like posix_spawn does for external ones
+            setpgid(0, job->pgid);
+            if(shell_interactive && !job->background){
+                tcsetpgrp(STDIN_FILENO, getpgrp());
+            }
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+            if(last->next){
+                int fdr1 = dup2(wr[out_index + 1], 1);
                 
                 if(fdr1 < 0){
                     perror("Error occured during piping");
@@ -516,13 +1645,14 @@ int createpipe(struct command_t *command,int amount1)
             for(i = 0; i < (amount*2); i++){
                     close(wr[i]);
             }
+            if(group > 1){
+                exit(stage_pipeline(c, group, STDIN_FILENO, STDOUT_FILENO));
+            }
+            if(redirect(c) < 0){
+                exit(1);
+            }
             if(strcmp(c->name,"uniq") == 0){
-                if(c->arg_count>2){
-                    uniq(c->name,c->args[1]);
-                }
-                else{
-                    uniq(c->name,"");
-                }
+                uniq(c->arg_count,c->args);
             }
             else if(strcmp(c->name,"palindrome")==0 ){
                 if(c->arg_count >= 3){
@@ -533,40 +1663,59 @@ int createpipe(struct command_t *command,int amount1)
                 }
             }
             else if(strcmp(c->name,"mycp") == 0){
-                  if(c->arg_count != 4) perror("2 text files must be given");
-                  else if(strcmp(c->args[1],c->args[2]) == 0) perror("File names must be different");
-                  else{
-                    mycp(c->args[1], c->args[2]);
-              }
+                exit(mycp(c->arg_count, c->args) == 0 ? 0 : 1);
             }
             else if(strcmp(c->name,"chatroom") == 0){
-                chat(c->args[1],c->args[2]);
+                chat(c->arg_count, c->args);
             }
-            else{
-                int process =execvp(c->name,c->args);
-                if(process < 0 ){
-                        perror("Error occured during piping");
-                        exit(1);
-                }
+            else if(strcmp(c->name,"parallel") == 0){
+                exit(parallel(c->arg_count, c->args));
+            }
+            else if(strcmp(c->name,"psvis") == 0){
+                exit(psvis(c->arg_count, c->args));
             }
-      
+            else if(strcmp(c->name,"pstop") == 0){
+                exit(pstop(c->arg_count, c->args));
+            }
+            exit(0);
         }
-        else if(pid < 0){
+        else if(pid == -1){
             perror("Error occured during piping");
             exit(1);
         }
-        index += 2;
-        c = c->next;
+        if(pid > 0){
+            if(job->pgid == 0){
+                job->pgid = pid;
+            }
+            setpgid(pid, job->pgid); // also done by the child, whoever is first wins
+            job->procs = realloc(job->procs, (job->nprocs + 1) * sizeof(struct process));
+            memset(&job->procs[job->nprocs], 0, sizeof(struct process));
+            job->procs[job->nprocs].pid = pid;
+            job->procs[job->nprocs].name = strdup(c->name);
+            job->procs[job->nprocs].start = start;
+            job->nprocs++;
+        }
+        index += 2 * group;
+        c = last->next;
     }
     // CLOSING THE CHILD PIPES
     for(int a = 0; a < pipecount; a++){
         close(wr[a]);
     }
-    // WAIT FOR THE CHILD PROCESSES FINISH
-    for(int a = 0; a < (amount + 1); a++){
-            wait(0);
+
+    int status = 0;
+    if(job->nprocs == 0){
+        job_free(job);
+        status = 127;
+    }
+    else if(job->background){
+        printf("[%d] %d\n", job->id, job->pgid);
     }
-    return 0;
+    else{
+        status = job_foreground(job, false, &oldmask);
+    }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
 }
 
 
@@ -584,10 +1733,10 @@ int amountpipes(struct command_t *command)
 
 int amountredirections(struct command_t *command)
 {
-    int count,a=0;
+    int count=0,a=0;
     
-    while(a<3){
-        if(strcmp(command->redirects[a],"N/A") != 0){
+    while(a<4){
+        if(command->redirects[a] != NULL){
             count++;
         }
         a++;
@@ -597,241 +1746,5442 @@ int amountredirections(struct command_t *command)
 
 int execCommand(struct command_t *command)
 {
-    // Forking a child
-    pid_t pid = fork();
-  
-    if (pid == -1) {
+    pid_t pid;
+    sigset_t mask, oldmask;
+
+    // keep the SIGCHLD handler from reaping the child before we do
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    if (launch_command(command, STDIN_FILENO, STDOUT_FILENO, NULL, 0, -1, false, &pid) != 0) {
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        perror("Command not found!");
         return -1;
-    } else if (pid == 0) {
-        char path[MAX_STRING_LENGTH];
-        strcpy(path,"/bin/");
-        strcat(path,command->name);
-        
-        if (execv(path, command->args) < 0) {
-            perror("Command not found!");
-            return -1;
-        }
-        exit(0);
-    } else {
-        wait(NULL);
-        return 1;
     }
+    waitpid(pid, NULL, 0);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return 1;
 }
-  
 
-void uniq(char* command,char* param){
-    struct dictionary_t **dict = malloc(sizeof(struct dictionary_t));
-    char buffer[1024];
-    char msg[1024];
-    char* token;
-    strcat(command," ");
-    strcat(command,param);
-    FILE *file = popen(command,"r");
-    memset( buffer, '\0', sizeof( buffer ));
-    while(fgets(buffer,100,file)!=NULL){
-        strcat(msg,buffer);
+
+/**
+ * djb2 string hash used for the command table
+ * @param  str [description]
+ * @return     [description]
+ */
+unsigned long hash_string(const char *str)
+{
+    unsigned long h = 5381;
+    while(*str){
+        h = h*33 + (unsigned char)*str++;
     }
-    token= strtok(msg,"\n");
+    return h;
+}
 
-    while(token != NULL){
-        int amount = getDictionaryItem(*dict,token);
-        if(amount==0){
-            addDictionaryItem(*dict,token,1);
+/**
+ * Search every $PATH directory for an executable called name
+ * @param  name [description]
+ * @return      malloc'd absolute path, or NULL
+ */
+char *search_path(char *name)
+{
+    char *env = getenv("PATH");
+    if(env == NULL){
+        env = "/usr/local/bin:/usr/bin:/bin";
+    }
+    const char *dir = env;
+    while(1){
+        const char *end = strchr(dir, ':');
+        int dirlen = end ? (int)(end - dir) : (int)strlen(dir);
+        char *path = malloc(dirlen + strlen(name) + 2);
+        if(dirlen == 0){
+            sprintf(path, "./%s", name); // empty entry means cwd
         }
         else{
-            deleteDictionaryItem(*dict,token);
-            addDictionaryItem(*dict,token,amount+1);
+            sprintf(path, "%.*s/%s", dirlen, dir, name);
         }
-        printf("%s\n",token);
-        token = strtok(NULL,"\n");
-    }
-    
-    
-    struct dictionary_t *temp_dict= *dict;
-    while(temp_dict != NULL){
-        
-        if(strcmp(param,"-c")==0 || strcmp(param,"--count")==0){
-            printf("%d  %s\n",temp_dict->value,temp_dict->key);
+        struct stat st;
+        if(stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0){
+            return path;
         }
-        else{
-            printf("%s\n",temp_dict->key);
+        free(path);
+        if(end == NULL){
+            break;
         }
-        temp_dict= temp_dict->next;
+        dir = end + 1;
     }
-    free(dict);
-    pclose(file);
-    
+    return NULL;
 }
 
+/**
+ * Resolve a command name to an absolute path, searching $PATH only the
+ * first time a name is seen. The table is flushed when $PATH changes.
+ * @param  name [description]
+ * @return      path owned by the table (or name itself), NULL if not found
+ */
+char *hash_lookup(char *name)
+{
+    if(strchr(name, '/') != NULL){
+        return name; // explicit paths are never hashed
+    }
 
+    // an unset $PATH compares as empty, so the table still caches
+    const char *env = getenv("PATH");
+    if(env == NULL){
+        env = "";
+    }
+    if(hashed_path_env == NULL || strcmp(hashed_path_env, env) != 0){
+        hash_clear();
+        hashed_path_env = strdup(env);
+    }
 
-int getDictionaryItem(struct dictionary_t *dict,char* key){
-    struct dictionary_t *temp_dict = dict;
-    
-    while(temp_dict != NULL){
-        if(strcmp(temp_dict->key,key)==0){
-            return temp_dict->value;
+    unsigned long bucket = hash_string(name) % HASH_BUCKETS;
+    struct hash_entry *e;
+    for(e = command_hash[bucket]; e != NULL; e = e->next){
+        if(strcmp(e->name, name) == 0){
+            e->hits++;
+            return e->path;
         }
     }
-    return 0;
+
+    char *path = search_path(name);
+    if(path == NULL){
+        return NULL;
+    }
+    e = malloc(sizeof(struct hash_entry));
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = 1;
+    e->next = command_hash[bucket];
+    command_hash[bucket] = e;
+    return path;
 }
 
-void deleteDictionaryItem(struct dictionary_t *dict,char* key){
-    struct dictionary_t *current= dict;
-    struct dictionary_t *previous= NULL;
-    
-    while(current != NULL){
-        if(strcmp(current->key,key) == 0){
-            if(current->next != NULL){
-                if(previous != NULL){
-                    previous->next = current->next;
-                }
-                else{
-                    dict= current->next;
+/**
+ * Forget the cached path of a command
+ * @param name [description]
+ */
+void hash_remove(char *name)
+{
+    struct hash_entry **link = &command_hash[hash_string(name) % HASH_BUCKETS];
+    while(*link != NULL){
+        struct hash_entry *e = *link;
+        if(strcmp(e->name, name) == 0){
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+void hash_clear()
+{
+    for(int i = 0; i < HASH_BUCKETS; i++){
+        while(command_hash[i] != NULL){
+            struct hash_entry *e = command_hash[i];
+            command_hash[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(hashed_path_env);
+    hashed_path_env = NULL;
+}
+
+/**
+ * hash         list remembered commands
+ * hash -r      forget all remembered commands
+ * hash name... look up and remember the given commands
+ * @param  command [description]
+ * @return         [description]
+ */
+int hash_builtin(struct command_t *command)
+{
+    int found = 0;
+
+    if(command->arg_count <= 2){
+        for(int i = 0; i < HASH_BUCKETS; i++){
+            for(struct hash_entry *e = command_hash[i]; e != NULL; e = e->next){
+                if(!found++){
+                    printf("hits\tcommand\n");
                 }
+                printf("%4d\t%s\n", e->hits, e->path);
             }
-            else if(previous != NULL){
-                previous->next = NULL;
-            }
-            else{
-                dict= NULL;
-            }
-            free(current);
-            return;
         }
+        if(!found){
+            printf("%s: hash table empty\n", sysname);
+        }
+        return SUCCESS;
     }
-    
+
+    for(int i = 1; command->args[i] != NULL; i++){
+        if(strcmp(command->args[i], "-r") == 0){
+            hash_clear();
+        }
+        else if(hash_lookup(command->args[i]) == NULL){
+            printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+        }
+    }
+    return SUCCESS;
 }
 
-void addDictionaryItem(struct dictionary_t *dict,char* key,int value){
-    struct dictionary_t *temp = malloc(sizeof(struct dictionary_t));
-    temp->key= malloc(1+strlen(key));
-    strcpy(temp->key,strdup(key));
-    temp->value= value;
-    temp->next=dict;
-    dict=temp;
+
+/**
+ * Builtins run inside a forked copy of the shell, everything else is spawned
+ * @param  name [description]
+ * @return      [description]
+ */
+bool is_builtin(char *name)
+{
+    // an empty name is a command of only redirections, done by the child
+    return name[0] == 0 || strcmp(name, "uniq") == 0 || strcmp(name, "palindrome") == 0 ||
+           strcmp(name, "mycp") == 0 || strcmp(name, "chatroom") == 0 ||
+           strcmp(name, "parallel") == 0 || strcmp(name, "psvis") == 0 ||
+           strcmp(name, "pstop") == 0;
 }
 
+/**
+ * Start an external command with posix_spawn, which uses a vfork-style clone
+ * instead of duplicating the shell's page tables like fork does.
+ * @param  command [description]
+ * @param  in      fd to use as the child's stdin
+ * @param  out     fd to use as the child's stdout
+ * @param  fds     pipe fds to close in the child, may be NULL
+ * @param  nfds    [description]
+ * @param  pgid    process group to join, 0 to start a new one, -1 to inherit
+ * @param  background the job runs in the background, the terminal stays ours
+ * @param  pid     set to the child's pid on success
+ * @return         0 on success, an errno value otherwise
+ */
+int launch_command(struct command_t *command, int in, int out, int *fds, int nfds, pid_t pgid,
+                   bool background, pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    int r;
 
+    // the child starts with default signals and nothing blocked, whatever
+    // the shell ignores or blocks for job control
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGTSTP);
+    sigaddset(&sigs, SIGTTIN);
+    sigaddset(&sigs, SIGTTOU);
+    sigaddset(&sigs, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if(pgid >= 0){
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
 
-void chat(char* roomname, char* username){
-    char str1[100]="";
-    char str2[100]="";
-    char str3[100]="";
-    sprintf(str1,"/tmp/chatroom-%s",roomname);
-    sprintf(str2,"/tmp/chatroom-%s/%s",roomname,username);
-    sprintf(str3,"/tmp/chatroom-%s/server",roomname);
-    struct stat st = {0};
+    posix_spawn_file_actions_init(&actions);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    // hand the terminal to a new foreground job before it can read from it
+    if(pgid >= 0 && shell_interactive && !background){
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#endif
+    if(in != STDIN_FILENO){
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    }
+    if(out != STDOUT_FILENO){
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    }
+    for(int i = 0; i < nfds; i++){
+        posix_spawn_file_actions_addclose(&actions, fds[i]);
+    }
+    // redirections are applied after the pipe ends so they take precedence
+    if(command->redirects[0] != NULL){
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+            command->redirects[0], O_RDONLY, 0);
+    }
+    if(command->redirects[1] != NULL){
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+            command->redirects[1], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    }
+    else if(command->redirects[2] != NULL){
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+            command->redirects[2], O_WRONLY|O_CREAT|O_APPEND, 0644);
+    }
+    if(command->redirects[3] != NULL){
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO,
+            command->redirects[3], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    }
 
-    if (stat(str1, &st) == -1) {
-        mkdir(str1, 0700);
+    char *path = hash_lookup(command->name);
+    if(path == NULL){
+        r = ENOENT;
     }
-    
-    int clientPipe = open(str2, O_CREAT|O_WRONLY);
-    int serverPipe = open(str3, O_CREAT|O_WRONLY);
-    int otherclients;
-    pid_t pid;
-    char* buffer[BUFF_SIZE];
-    char message[256];
-    int size;
-    int save= dup(fileno(stdin));
-    int load= dup(fileno(stdout));
-    
-    struct dirent *currentdir;
-    DIR *dir = opendir(str1);
-
-   if (dir == NULL)
-   {
-       printf("Could not open current directory" );
-       exit(EXIT_FAILURE);
-   }
-    
-    
-    printf("Welcome to %s\n",roomname);
-    
-    while(1){
-        pid= fork();
-        if(pid == 0)
-        {
-            while(1){
-                
-                while((size=read(clientPipe,&buffer,BUFF_SIZE)) > 0){
-                    write(fileno(stdout), &buffer, size*sizeof(char));
-                }
-            }
-        }
-        else{
-            while(1){
-                fgets(message, 255,stdin);
-                message[strlen(message)-1]= '\0';
-                char msg[256];
-                sprintf(msg,"[%s] %s : %s",roomname,username,message);
-                printf("%s\n",msg);
-                if(strcmp(message,"exit")==0){
-                    close(clientPipe);
-                    close(serverPipe);
-                    exit(EXIT_SUCCESS);
-                }
-                while((currentdir = readdir(dir)) !=NULL){
-                    char str[100];
-                    sprintf(str,"/tmp/chatroom-%s/%s",roomname,currentdir->d_name);
-                    otherclients = open(str, O_CREAT|O_WRONLY);
-                    write(otherclients,&buffer,size*sizeof(char));
-                }
-            }
+    else{
+        r = posix_spawn(pid, path, &actions, &attr, command->args, environ);
+        if(r == ENOENT && path != command->name){
+            // the hashed binary is gone, search $PATH again once
+            hash_remove(command->name);
+            path = hash_lookup(command->name);
+            r = path ? posix_spawn(pid, path, &actions, &attr, command->args, environ) : ENOENT;
         }
-        close(clientPipe);
-        close(serverPipe);
-        fflush(stdin);
-        fflush(stdout);
-        dup2(save,fileno(stdin));
-        dup2(load, fileno(stdout));
-        exit(EXIT_SUCCESS);
     }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return r;
 }
 
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
+enum bench_formats {
+    BENCH_TEXT,
+    BENCH_JSON,
+    BENCH_CSV
+};
 
-void palindrome(int arg_count,char** args){
-    int index=1;
-    int size= arg_count;
-    bool check= true;
-    int count =1;
-    while(index < size){
-        if(args[index]==NULL){
-            break;
+// where bench results go: aligned columns for people, JSON or CSV for
+// scripts that compare runs
+struct bench_report {
+    enum bench_formats format;
+    int results;
+} bench_report;
+
+/**
+ * Print str as a JSON string, or as a CSV field
+ * @param str [description]
+ */
+void bench_quote(const char *str)
+{
+    putchar('"');
+    for(; *str; str++){
+        if(*str == '"' || (*str == '\\' && bench_report.format == BENCH_JSON)){
+            putchar(bench_report.format == BENCH_JSON ? '\\' : '"');
+            putchar(*str);
         }
-        check= true;
-        int head = 0;
-        int tail =strlen(args[index])-1;
-        while(tail>head){
-            if(args[index][head++] != args[index][tail--]){
-                check =false;
-            }
+        else if((unsigned char)*str < 0x20){
+            printf(bench_report.format == BENCH_JSON ? "\\u%04x" : " ", *str);
         }
-        
-        if(check){
-            printf("%d. %s\n",count,args[index]);
-            count++;
+        else{
+            putchar(*str);
         }
-        index++;
     }
-    if(count ==1){
-        printf("There is no palindrome words in the arguments.");
+    putchar('"');
+}
+
+/**
+ * Start a report, JSON output is one object with every result of the run
+ * @param format [description]
+ */
+void bench_begin(enum bench_formats format)
+{
+    bench_report.format = format;
+    bench_report.results = 0;
+    if(format == BENCH_JSON){
+        struct utsname un;
+        uname(&un);
+        printf("{\"shellax_bench\": 1, \"time\": %ld, \"host\": ", (long)time(NULL));
+        bench_quote(un.nodename);
+        printf(", \"kernel\": ");
+        bench_quote(un.release);
+        printf(", \"cpus\": %ld, \"results\": [", sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    else if(format == BENCH_CSV){
+        printf("bench,case,metric,value,unit\n");
+    }
+}
+
+/**
+ * One measurement
+ * @param bench  which benchmark, "parse", "spawn", ...
+ * @param config its parameters, so results of different runs line up
+ * @param metric [description]
+ * @param value  [description]
+ * @param unit   [description]
+ */
+void bench_result(const char *bench, const char *config, const char *metric,
+                  double value, const char *unit)
+{
+    switch(bench_report.format){
+    case BENCH_TEXT:
+        printf("%-9s %-34s %-20s %14.2f %s\n", bench, config, metric, value, unit);
+        break;
+    case BENCH_JSON:
+        printf("%s\n  {\"bench\": ", bench_report.results ? "," : "");
+        bench_quote(bench);
+        printf(", \"case\": ");
+        bench_quote(config);
+        printf(", \"metric\": ");
+        bench_quote(metric);
+        printf(", \"value\": %.6g, \"unit\": ", value);
+        bench_quote(unit);
+        putchar('}');
+        break;
+    case BENCH_CSV:
+        bench_quote(bench);
+        putchar(',');
+        bench_quote(config);
+        putchar(',');
+        bench_quote(metric);
+        printf(",%.6g,", value);
+        bench_quote(unit);
+        putchar('\n');
+        break;
+    }
+    bench_report.results++;
+    fflush(stdout); // benchmarks fork, nothing may be buffered twice
+}
+
+void bench_end()
+{
+    if(bench_report.format == BENCH_JSON){
+        printf("\n]}\n");
     }
-    printf("\n");
+    fflush(stdout);
+    bench_report.format = BENCH_TEXT;
 }
 
+/**
+ * Run a command line the way a script would and time it
+ * @param  line [description]
+ * @return      seconds, negative if it failed
+ */
+double bench_shell(const char *line)
+{
+    struct arena arena = {0};
+    struct command_t command;
+    char *copy = strdup(line);
+    memset(&command, 0, sizeof(command));
+    command.arena = &arena;
+
+    double start = now_seconds();
+    if(parse_command(copy, &command) == 0){
+        process_list(&command);
+    }
+    else{
+        last_status = 2;
+    }
+    double elapsed = now_seconds() - start;
+    free_command(&command);
+    arena_free(&arena);
+    free(copy);
+    if(last_status != 0){
+        fprintf(stderr, "bench: '%s' exited with %d\n", line, last_status);
+        return -1;
+    }
+    return elapsed;
+}
+
+/**
+ * Fill a scratch file with size_mb of lines. Each line is repeated
+ * repeat times in a row and there are only distinct different ones.
+ * @param  path     a mkstemp template, the file is left for the caller
+ * @param  size_mb  [description]
+ * @param  repeat   [description]
+ * @param  distinct [description]
+ * @return          [description]
+ */
+int bench_input(char *path, int size_mb, int repeat, int distinct)
+{
+    int fd = mkstemp(path);
+    if(fd < 0){
+        perror("bench");
+        return -1;
+    }
+    struct outbuf *out = arena_alloc(&stage_arena, sizeof(struct outbuf));
+    out->fd = fd;
+    out->queue = NULL;
+    out->len = 0;
+    char line[128];
+    size_t total = (size_t)size_mb << 20;
+    for(long i = 0; total > 0; i++){
+        int n = snprintf(line, sizeof(line), "%08ld the quick brown fox %ld\n",
+                         (i / repeat) % distinct, (i / repeat) % distinct * 7919);
+        n = (size_t)n < total ? n : (int)total;
+        out_write(out, line, n);
+        total -= n;
+    }
+    out_flush(out);
+    arena_reset(&stage_arena);
+    close(fd);
+    return 0;
+}
+
+/**
+ * bench spawn [count] [heap MB]
+ * Launch /bin/true count times through fork+execv and through
+ * launch_command and report launches per second for both. The optional
+ * heap size is touched first to mimic a shell with a large history/cache.
+ * @param  count   [description]
+ * @param  heap_mb [description]
+ * @return         [description]
+ */
+int bench_spawn(int count, int heap_mb)
+{
+    char *argv[] = {"true", NULL};
+    struct command_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.name = "/bin/true";
+    cmd.args = argv;
 
-void mycp(char *src, char *dst){
-  char buffer[1024];
-  int position;
+    char *heap = NULL;
+    if(heap_mb > 0){
+        heap = malloc((size_t)heap_mb << 20);
+        memset(heap, 1, (size_t)heap_mb << 20);
+    }
 
-  FILE *infile = popen(src,"r");
-  FILE *outfile = popen(dst, "w");
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
-  while (fgets(buffer,100,infile)!=NULL) {
-    write(fileno(outfile), &buffer, 1024);
-  }
+    double start = now_seconds();
+    for(int i = 0; i < count; i++){
+        pid_t pid = fork();
+        if(pid == 0){
+            execv(cmd.name, argv);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    double fork_time = now_seconds() - start;
 
+    start = now_seconds();
+    for(int i = 0; i < count; i++){
+        pid_t pid;
+        if(launch_command(&cmd, STDIN_FILENO, STDOUT_FILENO, NULL, 0, -1, false, &pid) == 0){
+            waitpid(pid, NULL, 0);
+        }
+    }
+    double spawn_time = now_seconds() - start;
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+    // and the whole way a typed command goes: job table, wait, status
+    struct arena arena = {0};
+    char line[] = "/bin/true";
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.arena = &arena;
+    parse_command(line, &cmd);
+    start = now_seconds();
+    for(int i = 0; i < count; i++){
+        process_command(&cmd);
+    }
+    double command_time = now_seconds() - start;
+    free_command(&cmd);
+    arena_free(&arena);
+
+    char config[64];
+    snprintf(config, sizeof(config), "heap=%dMB launches=%d", heap_mb, count);
+    bench_result("spawn", config, "fork_execv", fork_time / count * 1e6, "us");
+    bench_result("spawn", config, "posix_spawn", spawn_time / count * 1e6, "us");
+    bench_result("spawn", config, "process_command", command_time / count * 1e6, "us");
+    free(heap);
+    return SUCCESS;
+}
+
+/**
+ * Create a pipeline pipe: close-on-exec so spawned stages only keep the
+ * ends they dup2, and sized by the pipesize option
+ * @param  fds [description]
+ * @return     [description]
+ */
+int make_pipe(int fds[2])
+{
+    if(pipe2(fds, O_CLOEXEC) < 0){
+        return -1;
+    }
+    if(opt_pipe_size > 0){
+        // capped by /proc/sys/fs/pipe-max-size for unprivileged users
+        fcntl(fds[1], F_SETPIPE_SZ, opt_pipe_size);
+    }
+    return 0;
+}
+
+/**
+ * set                    show options
+ * set -o pipesize=BYTES  buffer size of pipeline pipes
+ * set +o pipesize        back to the kernel default
+ * set -o timing / +o timing  report every job like time does
+ * set -o threads / +o threads  run pipelines of builtins as threads
+ * @param  command [description]
+ * @return         [description]
+ */
+int set_builtin(struct command_t *command)
+{
+    char **args = command->args;
+
+    if(args[1] == NULL){
+        printf("pipesize\t%d\n", opt_pipe_size);
+        printf("timing  \t%s\n", opt_timing ? "on" : "off");
+        printf("threads \t%s\n", opt_threads ? "on" : "off");
+        return SUCCESS;
+    }
+    for(int i = 1; args[i] != NULL; i++){
+        bool on = strcmp(args[i], "-o") == 0;
+        if((!on && strcmp(args[i], "+o") != 0) || args[i+1] == NULL){
+            printf("-%s: set: usage: set [-o name[=value]] [+o name]\n", sysname);
+            return SUCCESS;
+        }
+        char *name = args[++i];
+        char *value = strchr(name, '=');
+        if(value != NULL){
+            *value++ = 0;
+        }
+        if(strcmp(name, "pipesize") == 0){
+            opt_pipe_size = on && value ? atoi(value) : 0;
+        }
+        else if(strcmp(name, "timing") == 0){
+            opt_timing = on;
+        }
+        else if(strcmp(name, "threads") == 0){
+            opt_threads = on;
+        }
+        else{
+            printf("-%s: set: %s: invalid option name\n", sysname, name);
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * bench pipe [MB]
+ * Push a file through a pipe to /dev/null with read/write and with
+ * copy_data's splice path, at the default and at a 1 MB pipe size
+ * @param  size_mb [description]
+ * @return         [description]
+ */
+int bench_pipe(int size_mb)
+{
+    char path[] = "/tmp/shellax-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){
+        perror("bench");
+        return SUCCESS;
+    }
+    unlink(path);
+    char *block = malloc(1 << 20);
+    for(int i = 0; i < (1 << 20); i++){
+        block[i] = 'a' + i % 26;
+    }
+    for(int i = 0; i < size_mb; i++){
+        write(fd, block, 1 << 20);
+    }
+
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    int saved_size = opt_pipe_size;
+
+    for(int mode = 0; mode < 4; mode++){
+        bool use_splice = mode & 1;
+        opt_pipe_size = mode & 2 ? 1 << 20 : 0;
+        int p[2];
+        make_pipe(p);
+        lseek(fd, 0, SEEK_SET);
+        double start = now_seconds();
+        pid_t pid = fork();
+        if(pid == 0){
+            close(p[0]);
+            if(use_splice){
+                copy_data(fd, p[1]);
+            }
+            else{
+                ssize_t n;
+                while((n = read(fd, block, 64 * 1024)) > 0){
+                    write(p[1], block, n);
+                }
+            }
+            _exit(0);
+        }
+        close(p[1]);
+        int devnull = open("/dev/null", O_WRONLY);
+        if(use_splice){
+            copy_data(p[0], devnull);
+        }
+        else{
+            ssize_t n;
+            while((n = read(p[0], block, 64 * 1024)) > 0){
+                write(devnull, block, n);
+            }
+        }
+        waitpid(pid, NULL, 0);
+        double elapsed = now_seconds() - start;
+        close(p[0]);
+        close(devnull);
+        char config[64];
+        snprintf(config, sizeof(config), "size=%dMB pipe=%s", size_mb, mode & 2 ? "1M" : "default");
+        bench_result("pipe", config, use_splice ? "splice" : "read_write",
+                     size_mb * 1.048576 / elapsed, "MB/s");
+    }
+
+    opt_pipe_size = saved_size;
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    free(block);
+    close(fd);
+    return SUCCESS;
+}
+
+/**
+ * bench parse [lines]
+ * Parse generated command lines one at a time, the way the prompt does,
+ * and then all of them as a single script
+ * @param  lines [description]
+ * @return       [description]
+ */
+int bench_parse(int lines)
+{
+    static const char *samples[] = {
+        "ls -la /usr/lib | grep so | wc -l",
+        "echo \"hello world\" 'single $quoted' plain\\ escaped >/tmp/out",
+        "make -j8 2>/tmp/err && ./run --verbose || echo failed",
+        "cat <input.txt | sort | uniq -c | sort -rn | head -n 10 >>log",
+        "cd /tmp; mkdir -p a/b/c; touch a/b/c/file && rm -r a &",
+    };
+    size_t total = 0;
+    for(int i = 0; i < lines; i++){
+        total += strlen(samples[i % 5]) + 1;
+    }
+    char *script = malloc(total + 1);
+    char *p = script;
+    for(int i = 0; i < lines; i++){
+        size_t len = strlen(samples[i % 5]);
+        memcpy(p, samples[i % 5], len);
+        p += len;
+        *p++ = '\n';
+    }
+    *p = 0;
+
+    struct arena arena = {0};
+    struct command_t command;
+    size_t pipelines = 0;
+
+    double start = now_seconds();
+    p = script;
+    for(int i = 0; i < lines; i++){
+        char *nl = strchr(p, '\n');
+        *nl = 0;
+        memset(&command, 0, sizeof(command));
+        command.arena = &arena;
+        parse_command(p, &command);
+        *nl = '\n';
+        p = nl + 1;
+        arena_reset(&arena);
+    }
+    double elapsed = now_seconds() - start;
+    char config[64];
+    snprintf(config, sizeof(config), "lines=%d", lines);
+    bench_result("parse", config, "per_line", lines / elapsed, "lines/s");
+    bench_result("parse", config, "per_line_bytes", total / elapsed / 1e6, "MB/s");
+
+    start = now_seconds();
+    memset(&command, 0, sizeof(command));
+    command.arena = &arena;
+    parse_command(script, &command);
+    for(struct command_t *c = &command; c != NULL; c = c->list_next){
+        pipelines++;
+    }
+    elapsed = now_seconds() - start;
+    bench_result("parse", config, "script", lines / elapsed, "lines/s");
+    bench_result("parse", config, "script_bytes", total / elapsed / 1e6, "MB/s");
+    bench_result("parse", config, "script_pipelines", pipelines, "pipelines");
+
+    arena_free(&arena);
+    free(script);
+    return SUCCESS;
+}
+
+/**
+ * bench history [entries]
+ * Fill a private history with generated lines and time Ctrl-R style
+ * substring searches through the trigram index against a plain scan
+ * @param  entries [description]
+ * @return         [description]
+ */
+int bench_history(int entries)
+{
+    static const char *verbs[] = {"git commit -m", "make -j", "grep -rn",
+                                  "ssh deploy@", "docker run --rm"};
+    static const char *queries[] = {"deploy@ host-42", "-j needle-999996",
+                                    "xyz", "-m fix-7", "--rm img-4"};
+    struct history h;
+    char line[128];
+
+    history_init(&h, NULL, entries);
+    double start = now_seconds();
+    for(int i = 0; i < entries; i++){
+        int len = snprintf(line, sizeof(line), "%s %s-%d", verbs[i % 5],
+                           i % 5 == 1 ? "needle" : i % 5 == 3 ? "host" :
+                           i % 5 == 4 ? "img" : "fix", i);
+        history_add(&h, line, len, false);
+    }
+    char config[64];
+    snprintf(config, sizeof(config), "entries=%d", entries);
+    bench_result("history", config, "add", entries / (now_seconds() - start), "entries/s");
+
+    start = now_seconds();
+    history_search(&h, "zzz", h.next); // builds the index
+    bench_result("history", config, "index", (now_seconds() - start) * 1e3, "ms");
+
+    for(int q = 0; q < 5; q++){
+        start = now_seconds();
+        long seq = history_search(&h, queries[q], h.next);
+        double indexed = now_seconds() - start;
+        start = now_seconds();
+        long found = -1;
+        for(size_t i = h.next; i-- > h.first && found < 0;){
+            if(memmem(h.lines[i % h.capacity], h.lens[i % h.capacity],
+                      queries[q], strlen(queries[q])) != NULL){
+                found = i;
+            }
+        }
+        double scanned = now_seconds() - start;
+        if(seq != found){
+            fprintf(stderr, "bench: '%s' found %ld indexed, %ld scanning\n",
+                    queries[q], seq, found);
+        }
+        snprintf(config, sizeof(config), "entries=%d query=%s", entries, queries[q]);
+        bench_result("history", config, "indexed", indexed * 1e6, "us");
+        bench_result("history", config, "scan", scanned * 1e6, "us");
+    }
+    history_free(&h);
+    return SUCCESS;
+}
+
+/**
+ * bench pipeline [MB] [stages]
+ * Push a file through cat | cat | ... pipelines of 1, 2, 4 ... stages,
+ * launched by createpipe like any typed pipeline
+ * @param  size_mb    [description]
+ * @param  max_stages [description]
+ * @return            [description]
+ */
+int bench_pipeline(int size_mb, int max_stages)
+{
+    char path[] = "/tmp/shellax-bench-XXXXXX";
+    if(bench_input(path, size_mb, 1, 1 << 30) < 0){
+        return SUCCESS;
+    }
+    size_t cap = strlen(path) + 16 + max_stages * 6;
+    char *line = malloc(cap);
+    for(int stages = 1; stages <= max_stages; stages *= 2){
+        int len = snprintf(line, cap, "cat %s", path);
+        for(int i = 1; i < stages; i++){
+            len += snprintf(line + len, cap - len, " | cat");
+        }
+        snprintf(line + len, cap - len, " >/dev/null");
+        double elapsed = bench_shell(line);
+        if(elapsed <= 0){
+            break;
+        }
+        char config[64];
+        snprintf(config, sizeof(config), "size=%dMB stages=%d", size_mb, stages);
+        bench_result("pipeline", config, "throughput", size_mb * 1.048576 / elapsed, "MB/s");
+    }
+    free(line);
+    unlink(path);
+    return SUCCESS;
+}
+
+/**
+ * bench uniq [MB]
+ * Run the uniq builtin over generated input: all lines distinct, runs of
+ * duplicates, and few distinct lines scattered everywhere for -a. Then a
+ * chain of uniq stages, as threads and as processes, on the same input
+ * and many times on a tiny one.
+ * @param  size_mb [description]
+ * @return         [description]
+ */
+int bench_uniq(int size_mb)
+{
+    static const struct {
+        const char *name;
+        int repeat, distinct;
+        const char *options;
+    } inputs[] = {
+        {"distinct", 1, 1 << 30, ""},
+        {"runs_of_16", 16, 1 << 30, ""},
+        {"runs_of_16", 16, 1 << 30, "-c"},
+        {"1000_keys", 1, 1000, "-a"},
+        {"1M_keys", 1, 1 << 20, "-a -c"},
+    };
+    char line[256], config[64];
+    for(size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++){
+        char path[] = "/tmp/shellax-bench-XXXXXX";
+        if(bench_input(path, size_mb, inputs[i].repeat, inputs[i].distinct) < 0){
+            return SUCCESS;
+        }
+        snprintf(line, sizeof(line), "uniq %s <%s >/dev/null", inputs[i].options, path);
+        double elapsed = bench_shell(line);
+        unlink(path);
+        if(elapsed > 0){
+            snprintf(config, sizeof(config), "size=%dMB input=%s %s", size_mb,
+                     inputs[i].name, inputs[i].options);
+            bench_result("uniq", config, "throughput", size_mb * 1.048576 / elapsed, "MB/s");
+        }
+    }
+
+    bool saved_threads = opt_threads;
+    char path[] = "/tmp/shellax-bench-XXXXXX", small[] = "/tmp/shellax-bench-XXXXXX";
+    if(bench_input(path, size_mb, 4, 1 << 30) < 0 || bench_input(small, 0, 1, 1) < 0){
+        return SUCCESS;
+    }
+    // a 0 MB input is empty, give the small one a few lines
+    int fd = open(small, O_WRONLY | O_APPEND);
+    write(fd, "a\na\nb\nc\nc\n", 10);
+    close(fd);
+    for(int threads = 1; threads >= 0; threads--){
+        opt_threads = threads;
+        const char *mode = threads ? "threads" : "processes";
+        snprintf(line, sizeof(line), "uniq <%s | uniq -c | uniq >/dev/null", path);
+        double elapsed = bench_shell(line);
+        if(elapsed > 0){
+            snprintf(config, sizeof(config), "size=%dMB chain=3 %s", size_mb, mode);
+            bench_result("uniq", config, "throughput", size_mb * 1.048576 / elapsed, "MB/s");
+        }
+        snprintf(line, sizeof(line), "uniq <%s | uniq -c | uniq >/dev/null", small);
+        int rounds = 500;
+        double start = now_seconds();
+        for(int i = 0; i < rounds && elapsed > 0; i++){
+            elapsed = bench_shell(line);
+        }
+        if(elapsed > 0){
+            snprintf(config, sizeof(config), "small chain=3 %s", mode);
+            bench_result("uniq", config, "latency", (now_seconds() - start) / rounds * 1e6, "us");
+        }
+    }
+    opt_threads = saved_threads;
+    unlink(path);
+    unlink(small);
+    return SUCCESS;
+}
+
+/**
+ * bench mycp [MB]
+ * Copy one large file with a single worker and with the default pool,
+ * then into a pipe through mycp's stdout path
+ * @param  size_mb [description]
+ * @return         [description]
+ */
+int bench_mycp(int size_mb)
+{
+    char src[] = "/tmp/shellax-bench-XXXXXX";
+    if(bench_input(src, size_mb, 1, 1 << 30) < 0){
+        return SUCCESS;
+    }
+    char dst[sizeof(src) + 4], line[256], config[64];
+    snprintf(dst, sizeof(dst), "%s.cp", src);
+    const char *cases[][2] = {
+        {"workers=1", "mycp -j 1 %s %s 2>/dev/null"},
+        {"workers=default", "mycp %s %s 2>/dev/null"},
+        {"to_pipe", "mycp %s - 2>/dev/null | cat >%s"},
+    };
+    for(int i = 0; i < 3; i++){
+        snprintf(line, sizeof(line), cases[i][1], src, dst);
+        double elapsed = bench_shell(line);
+        unlink(dst);
+        if(elapsed > 0){
+            snprintf(config, sizeof(config), "size=%dMB %s", size_mb, cases[i][0]);
+            bench_result("mycp", config, "throughput", size_mb * 1.048576 / elapsed, "MB/s");
+        }
+    }
+    unlink(src);
+    return SUCCESS;
+}
+
+/**
+ * bench all: every benchmark at a size that finishes in about a minute,
+ * meant for bench -f json all >results.json and comparing releases
+ * @return [description]
+ */
+int bench_suite()
+{
+    bench_parse(200000);
+    bench_text(256);
+    bench_spawn(1000, 0);
+    bench_spawn(1000, 256);
+    bench_pipe(256);
+    bench_pipeline(256, 8);
+    bench_uniq(64);
+    bench_mycp(256);
+    bench_history(200000);
+    bench_complete("");
+    bench_chat(100, 500, false);
+    bench_chat(100, 500, true);
+    bench_chatlog(200000);
+    return SUCCESS;
+}
+
+/**
+ * Micro-benchmarks for the shell's hot paths
+ * bench [-f text|json|csv] name [args]
+ * @param  command [description]
+ * @return         [description]
+ */
+int bench_builtin(struct command_t *command)
+{
+    char **args = command->args;
+    enum bench_formats format = BENCH_TEXT;
+
+    if(args[1] != NULL && strcmp(args[1], "-f") == 0 && args[2] != NULL){
+        format = strcmp(args[2], "json") == 0 ? BENCH_JSON :
+                 strcmp(args[2], "csv") == 0 ? BENCH_CSV : BENCH_TEXT;
+        args += 2;
+    }
+    const char *name = args[1] ? args[1] : "";
+    int n = args[1] && args[2] ? atoi(args[2]) : 0; // the usual size argument
+    bench_begin(format);
+
+    if(strcmp(name, "all") == 0){
+        bench_suite();
+    }
+    else if(strcmp(name, "spawn") == 0){
+        int heap_mb = args[2] && args[3] ? atoi(args[3]) : 0;
+        bench_spawn(n > 0 ? n : 1000, heap_mb);
+    }
+    else if(strcmp(name, "pipe") == 0){
+        bench_pipe(n > 0 ? n : 1024);
+    }
+    else if(strcmp(name, "pipeline") == 0){
+        int stages = args[2] && args[3] ? atoi(args[3]) : 8;
+        bench_pipeline(n > 0 ? n : 256, stages > 0 ? stages : 8);
+    }
+    else if(strcmp(name, "parse") == 0){
+        bench_parse(n > 0 ? n : 1000000);
+    }
+    else if(strcmp(name, "history") == 0){
+        bench_history(n > 0 ? n : 1000000);
+    }
+    else if(strcmp(name, "complete") == 0){
+        bench_complete(args[2] ? args[2] : "");
+    }
+    else if(strcmp(name, "uniq") == 0){
+        bench_uniq(n > 0 ? n : 64);
+    }
+    else if(strcmp(name, "text") == 0){
+        bench_text(n > 0 ? n : 256);
+    }
+    else if(strcmp(name, "mycp") == 0){
+        bench_mycp(n > 0 ? n : 256);
+    }
+    else if(strcmp(name, "chat") == 0){
+        // every client keeps the others' FIFOs open, stay below the fd limit
+        int clients = n > 900 ? 900 : n;
+        int messages = args[2] && args[3] ? atoi(args[3]) : 500;
+        bool shm = args[2] && args[3] && args[4] && strcmp(args[4], "shm") == 0;
+        bench_chat(clients > 0 ? clients : 200, messages > 0 ? messages : 500, shm);
+    }
+    else if(strcmp(name, "chatlog") == 0){
+        bench_chatlog(n > 0 ? n : 1000000);
+    }
+    else{
+        bench_end();
+        printf("usage: bench [-f text|json|csv] all\n");
+        printf("       bench spawn [count] [heap MB]\n");
+        printf("       bench pipe [MB]\n");
+        printf("       bench pipeline [MB] [stages]\n");
+        printf("       bench parse [lines]\n");
+        printf("       bench history [entries]\n");
+        printf("       bench complete [prefix]\n");
+        printf("       bench uniq [MB]\n");
+        printf("       bench text [MB]\n");
+        printf("       bench mycp [MB]\n");
+        printf("       bench chat [clients] [messages] [fifo|shm]\n");
+        printf("       bench chatlog [messages]\n");
+        return SUCCESS;
+    }
+    bench_end();
+    return SUCCESS;
+}
+
+
+/**
+ * Take over the terminal and install the SIGCHLD reaper. Job control
+ * signals are ignored by the shell itself, children get them back.
+ * @param interactive false for -c and script files, the terminal is left alone
+ */
+void init_shell(bool interactive)
+{
+    struct sigaction sa;
+
+    shell_interactive = interactive && isatty(STDIN_FILENO);
+    if(shell_interactive){
+        // wait until we are in the foreground before touching the terminal
+        while(tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())){
+            kill(-shell_pgid, SIGTTIN);
+        }
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        shell_pgid = getpid();
+        setpgid(shell_pgid, shell_pgid);
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART; // don't break the prompt's getchar()
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+/**
+ * Reap every child that changed state and record it in the job table,
+ * so finished background jobs never linger as zombies
+ * @param sig [description]
+ */
+void sigchld_handler(int sig)
+{
+    int saved_errno = errno;
+    int status;
+    struct rusage usage;
+    pid_t pid;
+
+    // wait4 instead of waitpid keeps what each child cost, for time
+    while((pid = wait4(-1, &status, WNOHANG|WUNTRACED|WCONTINUED, &usage)) > 0){
+        for(struct job *j = job_list; j != NULL; j = j->next){
+            for(int i = 0; i < j->nprocs; i++){
+                struct process *p = &j->procs[i];
+                if(p->pid != pid){
+                    continue;
+                }
+                if(WIFSTOPPED(status)){
+                    p->stopped = true;
+                    j->notified = false;
+                }
+                else if(WIFCONTINUED(status)){
+                    p->stopped = false;
+                }
+                else{
+                    p->status = status;
+                    p->usage = usage;
+                    p->end = now_seconds(); // clock_gettime is async-signal-safe
+                    p->completed = true;
+                }
+            }
+        }
+    }
+    errno = saved_errno;
+}
+
+/**
+ * SIGINT while the wait builtin sleeps, the shell otherwise ignores it
+ * @param sig [description]
+ */
+void sigint_wait_handler(int sig)
+{
+    (void)sig;
+    wait_interrupted = 1;
+}
+
+/**
+ * Text of a pipeline as the user typed it, for the job table
+ * @param  command [description]
+ * @return         [description]
+ */
+char *command_text(struct command_t *command)
+{
+    size_t len = 1;
+    for(struct command_t *c = command; c != NULL; c = c->next){
+        for(int i = 0; c->args[i] != NULL; i++){
+            len += strlen(c->args[i]) + 1;
+        }
+        len += 3;
+    }
+    char *text = malloc(len);
+    text[0] = 0;
+    for(struct command_t *c = command; c != NULL; c = c->next){
+        for(int i = 0; c->args[i] != NULL; i++){
+            if(i > 0){
+                strcat(text, " ");
+            }
+            strcat(text, c->args[i]);
+        }
+        if(c->next){
+            strcat(text, " | ");
+        }
+    }
+    return text;
+}
+
+/**
+ * Add an empty job to the table, SIGCHLD must be blocked
+ * @param  command [description]
+ * @return         [description]
+ */
+struct job *job_create(struct command_t *command)
+{
+    struct job *job = calloc(1, sizeof(struct job));
+    struct job **link = &job_list;
+    int id = 0;
+
+    while(*link != NULL){
+        if((*link)->id > id){
+            id = (*link)->id;
+        }
+        link = &(*link)->next;
+    }
+    job->id = id + 1;
+    job->command = command_text(command);
+    *link = job;
+    return job;
+}
+
+/**
+ * Unlink a job from the table and release it, SIGCHLD must be blocked
+ * @param job [description]
+ */
+void job_free(struct job *job)
+{
+    for(struct job **link = &job_list; *link != NULL; link = &(*link)->next){
+        if(*link == job){
+            *link = job->next;
+            break;
+        }
+    }
+    for(int i = 0; i < job->nprocs; i++){
+        free(job->procs[i].name);
+    }
+    free(job->procs);
+    free(job->command);
+    free(job);
+}
+
+bool job_is_completed(struct job *job)
+{
+    for(int i = 0; i < job->nprocs; i++){
+        if(!job->procs[i].completed){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool job_is_stopped(struct job *job)
+{
+    for(int i = 0; i < job->nprocs; i++){
+        if(!job->procs[i].completed && !job->procs[i].stopped){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sleep until every process of the job has finished or stopped.
+ * SIGCHLD must be blocked, mask is the signal mask to wait with.
+ * @param  job  [description]
+ * @param  mask [description]
+ * @return      exit status of the last stage, like $? in bash,
+ *              130 if the wait builtin was interrupted by SIGINT
+ */
+int job_wait(struct job *job, sigset_t *mask)
+{
+    sigset_t wait_mask = *mask;
+    sigdelset(&wait_mask, SIGCHLD);
+    sigdelset(&wait_mask, SIGINT);
+    while(!job_is_stopped(job)){
+        if(wait_interrupted){
+            return 128 + SIGINT;
+        }
+        sigsuspend(&wait_mask);
+    }
+    int status = job->procs[job->nprocs - 1].status;
+    if(WIFSIGNALED(status)){
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+/**
+ * Give the terminal to a job, optionally continue it, and wait for it.
+ * A job that finishes is removed, one that stops stays in the table.
+ * @param  job  [description]
+ * @param  cont send SIGCONT first (fg)
+ * @param  mask signal mask to wait with, SIGCHLD must be blocked
+ * @return      [description]
+ */
+int job_foreground(struct job *job, bool cont, sigset_t *mask)
+{
+    job->background = false;
+    if(shell_interactive){
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    if(cont){
+        for(int i = 0; i < job->nprocs; i++){
+            job->procs[i].stopped = false;
+        }
+        kill(-job->pgid, SIGCONT);
+    }
+
+    int status = job_wait(job, mask);
+
+    if(shell_interactive){
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+    }
+    if(job_is_completed(job)){
+        if(job->timed){
+            job_report(job);
+        }
+        job_free(job);
+    }
+    else{
+        printf("\n[%d]+  Stopped                 %s\n", job->id, job->command);
+        job->notified = true;
+        job->background = true;
+        status = 128 + SIGTSTP;
+    }
+    return status;
+}
+
+/**
+ * Report background jobs that finished or stopped since the last prompt
+ */
+void job_notify()
+{
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    struct job *job = job_list;
+    while(job != NULL){
+        struct job *next = job->next;
+        if(job_is_completed(job)){
+            printf("[%d]+  Done                    %s\n", job->id, job->command);
+            if(job->timed){
+                job_report(job);
+            }
+            job_free(job);
+        }
+        else if(job_is_stopped(job) && !job->notified){
+            printf("[%d]+  Stopped                 %s\n", job->id, job->command);
+            job->notified = true;
+        }
+        job = next;
+    }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+/**
+ * Print what every stage of a finished job cost, to stderr like bash's time
+ * @param job [description]
+ */
+void job_report(struct job *job)
+{
+    double first = job->procs[0].start, last = 0;
+    struct timeval user = {0, 0}, sys = {0, 0};
+
+    fflush(stdout); // keep it after the job's own "Done" line
+    fprintf(stderr, "\n%-5s %-12s %9s %9s %9s %9s %7s %7s\n", "stage", "command",
+            "real", "user", "sys", "maxrss", "vcsw", "ivcsw");
+    for(int i = 0; i < job->nprocs; i++){
+        struct process *p = &job->procs[i];
+        struct rusage *ru = &p->usage;
+        fprintf(stderr, "%-5d %-12.12s %8.3fs %8.3fs %8.3fs %8ldk %7ld %7ld\n", i + 1, p->name,
+                p->end - p->start,
+                ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+                ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+                ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+        if(p->start < first){
+            first = p->start;
+        }
+        if(p->end > last){
+            last = p->end;
+        }
+        timeradd(&user, &ru->ru_utime, &user);
+        timeradd(&sys, &ru->ru_stime, &sys);
+    }
+    fprintf(stderr, "%-5s %-12s %8.3fs %8.3fs %8.3fs\n", "total", "", last - first,
+            user.tv_sec + user.tv_usec / 1e6, sys.tv_sec + sys.tv_usec / 1e6);
+}
+
+/**
+ * Find a job by %n, by pid, or the most recent one when spec is NULL.
+ * SIGCHLD must be blocked.
+ * @param  spec [description]
+ * @return      [description]
+ */
+struct job *job_find(char *spec)
+{
+    struct job *found = NULL;
+    int id = -1;
+    pid_t pid = -1;
+
+    if(spec != NULL){
+        if(spec[0] == '%'){
+            id = atoi(spec + 1);
+        }
+        else{
+            pid = atoi(spec);
+        }
+    }
+    for(struct job *j = job_list; j != NULL; j = j->next){
+        if(spec == NULL){
+            found = j; // the list is in creation order, keep the last
+        }
+        else if(j->id == id){
+            return j;
+        }
+        else{
+            for(int i = 0; i < j->nprocs; i++){
+                if(j->procs[i].pid == pid){
+                    return j;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+/**
+ * jobs           list jobs
+ * fg [%n]        continue a job in the foreground
+ * bg [%n]        continue a stopped job in the background
+ * wait [%n|pid]  wait for one job, or for all background jobs
+ * @param  command [description]
+ * @return         [description]
+ */
+int jobs_builtin(struct command_t *command)
+{
+    sigset_t mask, oldmask;
+    char *name = command->name;
+    char *spec = command->args[1];
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    if(strcmp(name, "jobs") == 0){
+        for(struct job *j = job_list; j != NULL; j = j->next){
+            const char *state = job_is_completed(j) ? "Done" :
+                                job_is_stopped(j) ? "Stopped" : "Running";
+            printf("[%d]%c  %-22s  %s%s\n", j->id, j->next ? ' ' : '+', state,
+                   j->command, j->background && !job_is_stopped(j) ? " &" : "");
+        }
+    }
+    else if(strcmp(name, "wait") == 0){
+        // Ctrl+C reaches the shell while it waits, let it end the wait like
+        // bash does; a non-interactive shell keeps the default and dies
+        struct sigaction sa, oldsa;
+        if(shell_interactive){
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = sigint_wait_handler;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGINT, &sa, &oldsa);
+        }
+        wait_interrupted = 0;
+        if(spec != NULL){
+            struct job *j = job_find(spec);
+            if(j == NULL){
+                printf("-%s: wait: %s: no such job\n", sysname, spec);
+                last_status = 127;
+            }
+            else{
+                last_status = job_wait(j, &oldmask);
+                if(job_is_completed(j)){
+                    job_free(j); // waited for, no need to report it as Done
+                }
+            }
+        }
+        else{
+            struct job *j = job_list;
+            while(j != NULL && !wait_interrupted){
+                struct job *next = j->next;
+                if(!job_is_stopped(j)){
+                    job_wait(j, &oldmask);
+                }
+                if(job_is_completed(j)){
+                    job_free(j);
+                }
+                j = next;
+            }
+            last_status = wait_interrupted ? 128 + SIGINT : 0;
+        }
+        if(shell_interactive){
+            sigaction(SIGINT, &oldsa, NULL);
+            if(wait_interrupted){
+                printf("\n"); // the terminal only echoed ^C
+            }
+        }
+        wait_interrupted = 0;
+    }
+    else{
+        struct job *j = job_find(spec);
+        if(j == NULL){
+            printf("-%s: %s: %s: no such job\n", sysname, name, spec ? spec : "current");
+        }
+        else if(strcmp(name, "fg") == 0){
+            printf("%s\n", j->command);
+            last_status = job_foreground(j, true, &oldmask);
+        }
+        else{
+            for(int i = 0; i < j->nprocs; i++){
+                j->procs[i].stopped = false;
+            }
+            j->background = true;
+            kill(-j->pgid, SIGCONT);
+            printf("[%d]+ %s &\n", j->id, j->command);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return SUCCESS;
+}
+
+
+// hand data to whatever is behind o, dropped if that is gone
+void out_send(struct outbuf *o, const char *data, size_t len)
+{
+    if(o->queue != NULL){
+        stage_queue_write(o->queue, data, len);
+        return;
+    }
+    while(len > 0){
+        ssize_t n = write(o->fd, data, len);
+        if(n <= 0){
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+void out_write(struct outbuf *o, const char *data, size_t len)
+{
+    if(o->len + len > OUTBUF_SIZE){
+        out_flush(o);
+        if(len > OUTBUF_SIZE){
+            out_send(o, data, len);
+            return;
+        }
+    }
+    memcpy(o->data + o->len, data, len);
+    o->len += len;
+}
+
+void out_flush(struct outbuf *o)
+{
+    out_send(o, o->data, o->len);
+    o->len = 0;
+}
+
+// state of uniq between input blocks
+struct uniq_state {
+    bool count;        // -c
+    bool all;          // -a, merge duplicates anywhere in the input
+    struct outbuf *out;
+    char *prev;        // last distinct line, only the previous one is kept
+    size_t prev_len;
+    size_t prev_cap;
+    long prev_count;
+    struct count_table table;
+};
+
+void uniq_emit(struct uniq_state *u, const char *line, size_t len, long count)
+{
+    if(u->count){
+        char num[32];
+        int n = snprintf(num, sizeof(num), "%7ld ", count);
+        out_write(u->out, num, n);
+    }
+    out_write(u->out, line, len);
+    out_write(u->out, "\n", 1);
+}
+
+void uniq_line(struct uniq_state *u, const char *line, size_t len)
+{
+    if(u->all){
+        (*count_table_add(&u->table, line, len))++;
+        return;
+    }
+    if(u->prev_count > 0 && len == u->prev_len && text_equal(line, u->prev, len)){
+        u->prev_count++;
+        return;
+    }
+    if(u->prev_count > 0){
+        uniq_emit(u, u->prev, u->prev_len, u->prev_count);
+    }
+    if(len > u->prev_cap){
+        u->prev_cap = len * 2;
+        u->prev = realloc(u->prev, u->prev_cap);
+    }
+    memcpy(u->prev, line, len);
+    u->prev_len = len;
+    u->prev_count = 1;
+}
+
+void uniq(int arg_count, char **args){
+    struct stage_input in = {STDIN_FILENO, NULL, 0};
+    struct outbuf *out = malloc(sizeof(struct outbuf));
+    out->fd = STDOUT_FILENO;
+    out->queue = NULL;
+    out->len = 0;
+    uniq_stage(arg_count, args, &in, out);
+    free(out);
+}
+
+/**
+ * uniq [-c|--count] [-a|--all]
+ * Reads stdin in large blocks and collapses adjacent duplicate lines as it
+ * goes, like GNU uniq, so memory only depends on the longest line. With -a
+ * every duplicate is merged and lines are printed in first-seen order once
+ * the input ends.
+ * @param  arg_count [description]
+ * @param  args      [description]
+ * @param  in        [description]
+ * @param  out       [description]
+ * @return           exit status
+ */
+int uniq_stage(int arg_count, char **args, struct stage_input *in, struct outbuf *out){
+    struct uniq_state u;
+    int status = 0;
+    memset(&u, 0, sizeof(u));
+    u.out = out;
+
+    for(int i = 1; i < arg_count && args[i] != NULL; i++){
+        if(strcmp(args[i],"-c")==0 || strcmp(args[i],"--count")==0){
+            u.count = true;
+        }
+        else if(strcmp(args[i],"-a")==0 || strcmp(args[i],"--all")==0){
+            u.all = true;
+        }
+        else{
+            fprintf(stderr, "uniq: invalid option '%s'\n", args[i]);
+            return 1;
+        }
+    }
+    if(u.all){
+        count_table_init(&u.table);
+    }
+
+    size_t block_size = 256 * 1024;
+    char *block = malloc(block_size);
+    char *carry = NULL; // line split across two reads
+    size_t carry_len = 0, carry_cap = 0;
+    ssize_t n;
+
+    while((n = stage_read(in, block, block_size)) != 0){
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("uniq");
+            status = 1;
+            break;
+        }
+        char *p = block, *end = block + n;
+        char *nl;
+        struct line_scanner scan;
+        line_scanner_init(&scan, block, n);
+        while((nl = (char *)line_next(&scan)) != NULL){
+            if(carry_len > 0){
+                size_t part = nl - p;
+                if(carry_len + part > carry_cap){
+                    carry_cap = (carry_len + part) * 2;
+                    carry = realloc(carry, carry_cap);
+                }
+                memcpy(carry + carry_len, p, part);
+                uniq_line(&u, carry, carry_len + part);
+                carry_len = 0;
+            }
+            else{
+                uniq_line(&u, p, nl - p);
+            }
+            p = nl + 1;
+        }
+        if(p < end){
+            size_t part = end - p;
+            if(carry_len + part > carry_cap){
+                carry_cap = (carry_len + part) * 2;
+                carry = realloc(carry, carry_cap);
+            }
+            memcpy(carry + carry_len, p, part);
+            carry_len += part;
+        }
+    }
+    if(carry_len > 0){ // last line without a newline
+        uniq_line(&u, carry, carry_len);
+    }
+
+    if(u.all){
+        for(size_t i = 0; i < u.table.used; i++){
+            struct count_entry *e = &u.table.entries[i];
+            uniq_emit(&u, e->key, e->len, e->count);
+        }
+        count_table_free(&u.table);
+    }
+    else if(u.prev_count > 0){
+        uniq_emit(&u, u.prev, u.prev_len, u.prev_count);
+    }
+    out_flush(out);
+    free(block);
+    free(carry);
+    free(u.prev);
+    return status;
+}
+
+
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    struct arena_block *b = a->head;
+    if(b == NULL || b->used + size > b->size){
+        size_t block = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(struct arena_block) + block);
+        b->next = a->head;
+        b->used = 0;
+        b->size = block;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+char *arena_strndup(struct arena *a, const char *str, size_t len)
+{
+    char *copy = arena_alloc(a, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = 0;
+    return copy;
+}
+
+/**
+ * Forget everything allocated, keeping the newest block for reuse
+ * @param a [description]
+ */
+void arena_reset(struct arena *a)
+{
+    if(a->head == NULL){
+        return;
+    }
+    struct arena_block *keep = a->head;
+    a->head = keep->next;
+    arena_free(a);
+    keep->next = NULL;
+    keep->used = 0;
+    a->head = keep;
+}
+
+void arena_free(struct arena *a)
+{
+    while(a->head != NULL){
+        struct arena_block *b = a->head;
+        a->head = b->next;
+        free(b);
+    }
+}
+
+static uint64_t newline_mask_scalar(const char *p)
+{
+    // a byte of w ^ "\n\n\n..." is zero exactly where p has a newline,
+    // its high bit is set below and the 8 high bits gathered by a multiply
+    uint64_t mask = 0;
+    for(int i = 0; i < 64; i += 8){
+        uint64_t w, ones = 0x7f7f7f7f7f7f7f7fULL;
+        memcpy(&w, p + i, 8);
+        w ^= 0x0a0a0a0a0a0a0a0aULL;
+        uint64_t zero = ~(((w & ones) + ones) | w | ones);
+        mask |= ((zero >> 7) * 0x0102040810204080ULL >> 56) << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint64_t newline_mask_sse2(const char *p)
+{
+    __m128i nl = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for(int i = 0; i < 64; i += 16){
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t newline_mask_avx2(const char *p)
+{
+    __m256i nl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)) |
+           (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+}
+#endif
+
+// newline finders, best first; text_init picks the first the CPU has
+struct text_impl {
+    const char *name;
+    uint64_t (*newline_mask)(const char *p);
+} text_impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", newline_mask_avx2},
+    {"sse2", newline_mask_sse2},
+#endif
+    {"scalar", newline_mask_scalar},
+};
+
+uint64_t (*newline_mask)(const char *p) = newline_mask_scalar;
+
+static bool text_impl_supported(struct text_impl *impl)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(impl->newline_mask == newline_mask_avx2){
+        return __builtin_cpu_supports("avx2");
+    }
+    if(impl->newline_mask == newline_mask_sse2){
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return true;
+}
+
+/**
+ * Pick the newline finder for this CPU. SHELLAX_SIMD=scalar|sse2|avx2
+ * forces one, as long as the CPU has it.
+ */
+void text_init()
+{
+    const char *forced = getenv("SHELLAX_SIMD");
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#endif
+    for(size_t i = 0; i < sizeof(text_impls) / sizeof(text_impls[0]); i++){
+        if(text_impl_supported(&text_impls[i]) &&
+           (forced == NULL || strcmp(forced, text_impls[i].name) == 0)){
+            newline_mask = text_impls[i].newline_mask;
+            return;
+        }
+    }
+}
+
+// the last window is shorter than 64 bytes, padding has no newlines
+static uint64_t newline_mask_tail(const char *p, size_t len)
+{
+    char window[64] = {0};
+    memcpy(window, p, len);
+    return newline_mask(window);
+}
+
+void line_scanner_init(struct line_scanner *s, const char *data, size_t len)
+{
+    s->data = data;
+    s->len = len;
+    s->window = 0;
+    s->mask = len == 0 ? 0 : len >= 64 ? newline_mask(data) : newline_mask_tail(data, len);
+}
+
+/**
+ * The next newline, scanning forward from the previous one
+ * @param  s [description]
+ * @return   NULL when there is none left
+ */
+const char *line_next(struct line_scanner *s)
+{
+    while(s->mask == 0){
+        s->window += 64;
+        if(s->window >= s->len){
+            return NULL;
+        }
+        size_t left = s->len - s->window;
+        s->mask = left >= 64 ? newline_mask(s->data + s->window) :
+                               newline_mask_tail(s->data + s->window, left);
+    }
+    const char *nl = s->data + s->window + __builtin_ctzll(s->mask);
+    s->mask &= s->mask - 1;
+    return nl;
+}
+
+size_t line_count(const char *data, size_t len)
+{
+    size_t count = 0, i = 0;
+    for(; i + 64 <= len; i += 64){
+        count += __builtin_popcountll(newline_mask(data + i));
+    }
+    if(i < len){
+        count += __builtin_popcountll(newline_mask_tail(data + i, len - i));
+    }
+    return count;
+}
+
+// memcmp is a call, lines are mostly short: up to 16 bytes take two loads
+bool text_equal(const char *a, const char *b, size_t len)
+{
+    if(len >= 8 && len <= 16){
+        uint64_t a0, a1, b0, b1;
+        memcpy(&a0, a, 8);
+        memcpy(&b0, b, 8);
+        memcpy(&a1, a + len - 8, 8);
+        memcpy(&b1, b + len - 8, 8);
+        return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+    }
+    return memcmp(a, b, len) == 0;
+}
+
+/**
+ * Hash a byte range, lines are not NUL terminated while streaming. Each
+ * 8 byte word is xored in and multiplied, the tail is zero padded, and
+ * the result goes through MurmurHash3's fmix64 finalizer.
+ * @param  data [description]
+ * @param  len  [description]
+ * @return      [description]
+ */
+unsigned long hash_bytes(const char *data, size_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, w;
+    for(; len >= 8; data += 8, len -= 8){
+        memcpy(&w, data, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    if(len > 0){
+        w = 0;
+        memcpy(&w, data, len);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * bench text [MB]
+ * Newline scanning with memchr and with every newline finder the CPU has,
+ * over long and short lines, then line hashing and compares. One thread,
+ * so the rates are per core.
+ * @param  size_mb [description]
+ * @return         [description]
+ */
+int bench_text(int size_mb)
+{
+    size_t size = (size_t)size_mb << 20;
+    char *data = malloc(size);
+    uint64_t (*saved)(const char *p) = newline_mask;
+    char config[64];
+
+    for(int shape = 0; shape < 2; shape++){
+        // ~40 byte lines like source or logs, ~8 byte ones like word lists
+        int width = shape ? 8 : 40;
+        for(size_t i = 0; i < size; i++){
+            data[i] = i % width == (size_t)width - 1 ? '\n' : 'a' + (i * 7 + i / width) % 26;
+        }
+        snprintf(config, sizeof(config), "size=%dMB line=%d", size_mb, width);
+
+        double start = now_seconds();
+        size_t lines = 0;
+        for(const char *p = data, *end = data + size, *nl;
+            (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1){
+            lines++;
+        }
+        bench_result("text", config, "memchr", size / (now_seconds() - start) / 1e9, "GB/s");
+
+        for(size_t k = 0; k < sizeof(text_impls) / sizeof(text_impls[0]); k++){
+            if(!text_impl_supported(&text_impls[k])){
+                continue;
+            }
+            char metric[32];
+            newline_mask = text_impls[k].newline_mask;
+            struct line_scanner scan;
+            size_t found = 0;
+            start = now_seconds();
+            line_scanner_init(&scan, data, size);
+            while(line_next(&scan) != NULL){
+                found++;
+            }
+            snprintf(metric, sizeof(metric), "scan_%s", text_impls[k].name);
+            bench_result("text", config, metric, size / (now_seconds() - start) / 1e9, "GB/s");
+
+            start = now_seconds();
+            size_t counted = line_count(data, size);
+            snprintf(metric, sizeof(metric), "count_%s", text_impls[k].name);
+            bench_result("text", config, metric, size / (now_seconds() - start) / 1e9, "GB/s");
+            if(found != lines || counted != lines){
+                fprintf(stderr, "bench: %s found %zu and counted %zu of %zu lines\n",
+                        text_impls[k].name, found, counted, lines);
+            }
+        }
+        newline_mask = saved;
+
+        unsigned long sum = 0;
+        start = now_seconds();
+        for(size_t i = 0; i + width <= size; i += width){
+            sum += hash_bytes(data + i, width - 1);
+        }
+        bench_result("text", config, "hash", size / (now_seconds() - start) / 1e9, "GB/s");
+
+        size_t equal = 0;
+        start = now_seconds();
+        for(size_t i = width; i + width <= size; i += width){
+            equal += text_equal(data + i - width, data + i, width - 1) + (sum & 1);
+        }
+        bench_result("text", config, "compare", size / (now_seconds() - start) / 1e9, "GB/s");
+        if(equal > size){
+            printf("%zu\n", equal); // keeps the loops from being optimized out
+        }
+    }
+    free(data);
+    return SUCCESS;
+}
+
+void count_table_init(struct count_table *t)
+{
+    memset(t, 0, sizeof(struct count_table));
+    t->nslots = 64;
+    t->slots = calloc(t->nslots, sizeof(unsigned int));
+}
+
+/**
+ * Find or insert key, keys are copied into the table's arena on insert
+ * @param  t   [description]
+ * @param  key [description]
+ * @param  len [description]
+ * @return     pointer to the key's counter, 0 for a new key
+ */
+long *count_table_add(struct count_table *t, const char *key, size_t len)
+{
+    unsigned long h = hash_bytes(key, len);
+    size_t mask = t->nslots - 1;
+    size_t i = h & mask;
+
+    while(t->slots[i] != 0){
+        struct count_entry *e = &t->entries[t->slots[i] - 1];
+        if(e->hash == h && e->len == len && text_equal(e->key, key, len)){
+            return &e->count;
+        }
+        i = (i + 1) & mask;
+    }
+
+    if(t->used == t->capacity){
+        t->capacity = t->capacity ? t->capacity * 2 : 64;
+        t->entries = realloc(t->entries, t->capacity * sizeof(struct count_entry));
+    }
+    struct count_entry *e = &t->entries[t->used++];
+    e->key = arena_strndup(&t->keys, key, len);
+    e->len = len;
+    e->hash = h;
+    e->count = 0;
+    t->slots[i] = t->used;
+
+    // keep the load factor under 3/4, rehashing only needs the stored hashes
+    if(t->used * 4 >= t->nslots * 3){
+        free(t->slots);
+        t->nslots *= 2;
+        mask = t->nslots - 1;
+        t->slots = calloc(t->nslots, sizeof(unsigned int));
+        for(size_t n = 0; n < t->used; n++){
+            i = t->entries[n].hash & mask;
+            while(t->slots[i] != 0){
+                i = (i + 1) & mask;
+            }
+            t->slots[i] = n + 1;
+        }
+    }
+    return &e->count;
+}
+
+void count_table_free(struct count_table *t)
+{
+    free(t->entries);
+    free(t->slots);
+    arena_free(&t->keys);
+}
+
+
+
+/**
+ * Open a member's FIFO for writing. Non-blocking, so a member that stopped
+ * reading can't stall the room; ENXIO means nobody reads it anymore.
+ * @param room [description]
+ * @param name [description]
+ */
+void chat_member_add(struct chat_room *room, const char *name)
+{
+    char path[512];
+    struct stat st;
+
+    if(strcmp(name, room->self) == 0){
+        return;
+    }
+    for(size_t i = 0; i < room->nmembers; i++){
+        if(strcmp(room->members[i].name, name) == 0){
+            return;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%s", room->dir, name);
+    if(stat(path, &st) < 0 || !S_ISFIFO(st.st_mode)){
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0){
+        return;
+    }
+    if(room->nmembers == room->cap){
+        room->cap = room->cap ? room->cap * 2 : 16;
+        room->members = realloc(room->members, room->cap * sizeof(struct chat_member));
+    }
+    room->members[room->nmembers].name = strdup(name);
+    room->members[room->nmembers].fd = fd;
+    room->nmembers++;
+}
+
+void chat_member_remove(struct chat_room *room, size_t index)
+{
+    close(room->members[index].fd);
+    free(room->members[index].name);
+    room->members[index] = room->members[--room->nmembers];
+}
+
+/**
+ * Create our FIFO in the room and open every member that is already there
+ * @param  room     [description]
+ * @param  roomname [description]
+ * @param  username [description]
+ * @return          0, -1 if the room can't be joined
+ */
+int chat_join(struct chat_room *room, const char *roomname, const char *username)
+{
+    memset(room, 0, sizeof(*room));
+    room->self = username;
+    snprintf(room->dir, sizeof(room->dir), "/tmp/chatroom-%s", roomname);
+    snprintf(room->self_path, sizeof(room->self_path), "%s/%s", room->dir, username);
+    if(mkdir(room->dir, 0777) < 0 && errno != EEXIST){
+        perror(room->dir);
+        return -1;
+    }
+    chmod(room->dir, 01777); // anyone may join, like /tmp itself
+
+    struct stat st;
+    if(lstat(room->self_path, &st) == 0 && !S_ISFIFO(st.st_mode)){
+        unlink(room->self_path);
+    }
+    if(mkfifo(room->self_path, 0622) < 0 && errno != EEXIST){
+        perror(room->self_path);
+        return -1;
+    }
+    room->self_fd = open(room->self_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if(room->self_fd < 0){
+        perror(room->self_path);
+        return -1;
+    }
+
+    // watch before listing, so nobody joining in between is missed
+    room->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    inotify_add_watch(room->inotify_fd, room->dir,
+                      IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
+    DIR *dir = opendir(room->dir);
+    struct dirent *entry;
+    while(dir != NULL && (entry = readdir(dir)) != NULL){
+        if(entry->d_name[0] != '.'){
+            chat_member_add(room, entry->d_name);
+        }
+    }
+    if(dir != NULL){
+        closedir(dir);
+    }
+    return 0;
+}
+
+/**
+ * Apply the joins and leaves inotify reported since the last call
+ * @param room [description]
+ */
+void chat_refresh(struct chat_room *room)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while((n = read(room->inotify_fd, buf, sizeof(buf))) > 0){
+        for(char *p = buf; p < buf + n;){
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if(ev->len == 0){
+                continue;
+            }
+            if(ev->mask & (IN_CREATE | IN_MOVED_TO)){
+                chat_member_add(room, ev->name);
+                continue;
+            }
+            for(size_t i = 0; i < room->nmembers; i++){
+                if(strcmp(room->members[i].name, ev->name) == 0){
+                    chat_member_remove(room, i);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Write one message to every other member, one write() each. A member
+ * whose FIFO is full misses the message rather than holding up the room.
+ * @param  room [description]
+ * @param  msg  [description]
+ * @param  len  at most CHAT_MESSAGE_MAX
+ * @return      members that got it
+ */
+size_t chat_send(struct chat_room *room, const char *msg, size_t len)
+{
+    size_t sent = 0;
+    for(size_t i = 0; i < room->nmembers;){
+        ssize_t n = write(room->members[i].fd, msg, len);
+        if(n < 0 && errno == EPIPE){
+            chat_member_remove(room, i); // left without removing its FIFO
+            continue;
+        }
+        if(n == (ssize_t)len){
+            sent++;
+        }
+        i++;
+    }
+    return sent;
+}
+
+void chat_leave(struct chat_room *room)
+{
+    while(room->nmembers > 0){
+        chat_member_remove(room, room->nmembers - 1);
+    }
+    free(room->members);
+    close(room->inotify_fd);
+    close(room->self_fd);
+    unlink(room->self_path);
+}
+
+static void chat_ring_copy_in(struct chat_ring *ring, uint64_t pos, const void *src, size_t len)
+{
+    size_t off = pos & (ring->size - 1);
+    size_t first = len < ring->size - off ? len : ring->size - off;
+    memcpy(ring->data + off, src, first);
+    memcpy(ring->data, (const char *)src + first, len - first);
+}
+
+static void chat_ring_copy_out(struct chat_ring *ring, uint64_t pos, void *dst, size_t len)
+{
+    size_t off = pos & (ring->size - 1);
+    size_t first = len < ring->size - off ? len : ring->size - off;
+    memcpy(dst, ring->data + off, first);
+    memcpy((char *)dst + first, ring->data, len - first);
+}
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    // not FUTEX_PRIVATE_FLAG, the word lives in a shared mapping
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/**
+ * Take the ring's lock, recovering it from a member that died holding it
+ * @param ring [description]
+ */
+static void chat_ring_lock(struct chat_ring *ring)
+{
+    if(pthread_mutex_lock(&ring->lock) == EOWNERDEAD){
+        // head is only moved once a record is complete and the member
+        // table is changed a slot at a time, so the ring itself is fine
+        pthread_mutex_consistent(&ring->lock);
+    }
+}
+
+/**
+ * Forget members that exited without leaving, killed or crashed. The ring
+ * lock must be held.
+ * @param  ring [description]
+ * @return      members still alive
+ */
+static int chat_ring_prune(struct chat_ring *ring)
+{
+    int alive = 0;
+    for(int i = 0; i < CHAT_RING_MEMBERS; i++){
+        if(ring->members[i] == 0){
+            continue;
+        }
+        if(kill(ring->members[i], 0) < 0 && errno == ESRCH){
+            ring->members[i] = 0;
+        }
+        else{
+            alive++;
+        }
+    }
+    return alive;
+}
+
+/**
+ * Map the room's ring, creating it if we are the first member, and add us
+ * to its member table. Reading starts at the newest message.
+ * @param  r        [description]
+ * @param  roomname [description]
+ * @return          0, -1 on failure
+ */
+int chat_shm_open(struct chat_shm *r, const char *roomname)
+{
+    char dir[256];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "/chatroom-%s", roomname);
+    snprintf(dir, sizeof(dir), "/tmp/chatroom-%s", roomname);
+    mkdir(dir, 0777); // the room stays discoverable under /tmp
+    r->map_len = sizeof(struct chat_ring) + CHAT_RING_SIZE;
+
+    // a ring its last member is closing right now is already unlinked,
+    // open again and get a fresh one
+    for(int attempt = 0; attempt < 100; attempt++){
+        bool creator = true;
+        int fd = shm_open(r->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if(fd < 0 && errno == EEXIST){
+            creator = false;
+            fd = shm_open(r->name, O_RDWR | O_CLOEXEC, 0666);
+        }
+        if(fd < 0 && errno == ENOENT){
+            continue; // unlinked between our two opens
+        }
+        if(fd < 0 || (creator && ftruncate(fd, r->map_len) < 0)){
+            perror(r->name);
+            if(fd >= 0){
+                close(fd);
+            }
+            return -1;
+        }
+        // a joiner racing the creator waits for the size and the magic
+        struct stat st;
+        for(int i = 0; !creator && fstat(fd, &st) == 0 && (size_t)st.st_size < r->map_len && i < 1000; i++){
+            usleep(1000);
+        }
+        r->ring = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(r->ring == MAP_FAILED){
+            perror(r->name);
+            return -1;
+        }
+
+        struct chat_ring *ring = r->ring;
+        if(creator){
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+            pthread_mutex_init(&ring->lock, &attr);
+            pthread_mutexattr_destroy(&attr);
+            ring->size = CHAT_RING_SIZE;
+            ring->seq = 1;
+            ring->members[0] = getpid();
+            __atomic_store_n(&ring->magic, CHAT_RING_MAGIC, __ATOMIC_RELEASE);
+            r->cursor = 0;
+            return 0;
+        }
+        for(int i = 0; __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != CHAT_RING_MAGIC; i++){
+            if(i == 1000){
+                fprintf(stderr, "%s: not a chatroom ring\n", r->name);
+                munmap(r->ring, r->map_len);
+                return -1;
+            }
+            usleep(1000);
+        }
+
+        chat_ring_lock(ring);
+        if(ring->closed){
+            pthread_mutex_unlock(&ring->lock);
+            munmap(r->ring, r->map_len);
+            continue;
+        }
+        chat_ring_prune(ring);
+        int slot = 0;
+        while(slot < CHAT_RING_MEMBERS && ring->members[slot] != 0){
+            slot++;
+        }
+        if(slot < CHAT_RING_MEMBERS){
+            ring->members[slot] = getpid();
+        }
+        pthread_mutex_unlock(&ring->lock);
+        if(slot == CHAT_RING_MEMBERS){
+            fprintf(stderr, "%s: room is full\n", r->name);
+            munmap(r->ring, r->map_len);
+            return -1;
+        }
+        r->cursor = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        return 0;
+    }
+    fprintf(stderr, "%s: room keeps closing\n", r->name);
+    return -1;
+}
+
+/**
+ * Append a message. Records that would be overwritten are dropped from
+ * the tail first, readers still on them notice and skip ahead.
+ * @param r   [description]
+ * @param msg [description]
+ * @param len at most CHAT_MESSAGE_MAX
+ */
+void chat_shm_publish(struct chat_shm *r, const char *msg, size_t len)
+{
+    struct chat_ring *ring = r->ring;
+    uint64_t reclen = sizeof(struct chat_record) + ((len + 7) & ~7UL);
+
+    chat_ring_lock(ring);
+    uint64_t head = ring->head, tail = ring->tail;
+    if(head + reclen - tail > ring->size){
+        while(head + reclen - tail > ring->size){
+            struct chat_record old;
+            chat_ring_copy_out(ring, tail, &old, sizeof(old));
+            tail += sizeof(struct chat_record) + ((old.len + 7) & ~7UL);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // tail moves before the data
+    }
+    struct chat_record rec = {len, 0, ring->seq++};
+    chat_ring_copy_in(ring, head, &rec, sizeof(rec));
+    chat_ring_copy_in(ring, head + sizeof(rec), msg, len);
+    __atomic_store_n(&ring->head, head + reclen, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ring->futex, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->lock);
+
+    // the syscall only happens when somebody is actually asleep
+    if(__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST) > 0){
+        futex(&ring->futex, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+/**
+ * Next message after our cursor
+ * @param  r          [description]
+ * @param  out        [description]
+ * @param  cap        [description]
+ * @param  timeout_ms how long to sleep if there is none, -1 forever
+ * @return            its length, 0 if the timeout passed
+ */
+ssize_t chat_shm_read(struct chat_shm *r, char *out, size_t cap, int timeout_ms)
+{
+    struct chat_ring *ring = r->ring;
+
+    while(1){
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if(r->cursor == head){
+            if(timeout_ms == 0){
+                return 0;
+            }
+            __atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+            uint32_t word = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+            long rc = 0;
+            if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == r->cursor){
+                struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+                rc = futex(&ring->futex, FUTEX_WAIT, word, timeout_ms < 0 ? NULL : &ts);
+            }
+            __atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+            if(rc < 0 && errno == ETIMEDOUT){
+                return 0;
+            }
+            continue;
+        }
+
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if(r->cursor < tail){
+            r->cursor = tail; // lapped by the writers
+        }
+        struct chat_record rec;
+        chat_ring_copy_out(ring, r->cursor, &rec, sizeof(rec));
+        size_t len = rec.len < cap ? rec.len : cap;
+        chat_ring_copy_out(ring, r->cursor + sizeof(rec), out, len);
+        // the record is only good if it wasn't overwritten while we copied
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > r->cursor){
+            continue;
+        }
+        if(r->next_seq != 0 && rec.seq > r->next_seq){
+            r->lost += rec.seq - r->next_seq;
+        }
+        r->next_seq = rec.seq + 1;
+        r->cursor += sizeof(rec) + ((rec.len + 7) & ~7UL);
+        return len;
+    }
+}
+
+/**
+ * Leave the room. The last member to leave unlinks the ring, so a room
+ * nobody is in doesn't keep its segment in /dev/shm; members that died
+ * without leaving are pruned from the table first.
+ * @param r [description]
+ */
+void chat_shm_close(struct chat_shm *r)
+{
+    struct chat_ring *ring = r->ring;
+    pid_t self = getpid();
+
+    chat_ring_lock(ring);
+    for(int i = 0; i < CHAT_RING_MEMBERS; i++){
+        if(ring->members[i] == self){
+            ring->members[i] = 0;
+        }
+    }
+    if(chat_ring_prune(ring) == 0){
+        // unlinked under the lock, a joiner that mapped it sees closed
+        ring->closed = 1;
+        shm_unlink(r->name);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    munmap(ring, r->map_len);
+    r->ring = NULL;
+}
+
+static void chat_log_path(struct chat_log *log, uint64_t segment, const char *ext,
+                          char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.%s", log->dir, (unsigned long long)segment, ext);
+}
+
+/**
+ * First sequence numbers of the segments on disk, ascending
+ * @param  log  [description]
+ * @param  list set to a malloc'd array
+ * @return      how many there are
+ */
+static size_t chat_log_segments(struct chat_log *log, uint64_t **list)
+{
+    size_t count = 0, cap = 16;
+    *list = malloc(cap * sizeof(uint64_t));
+    DIR *dir = opendir(log->dir);
+    struct dirent *entry;
+    while(dir != NULL && (entry = readdir(dir)) != NULL){
+        char *dot = strchr(entry->d_name, '.');
+        if(dot == NULL || strcmp(dot, ".seg") != 0){
+            continue;
+        }
+        if(count == cap){
+            *list = realloc(*list, (cap *= 2) * sizeof(uint64_t));
+        }
+        (*list)[count++] = strtoull(entry->d_name, NULL, 16);
+    }
+    if(dir != NULL){
+        closedir(dir);
+    }
+    for(size_t i = 1; i < count; i++){ // few segments, insertion sort
+        uint64_t v = (*list)[i];
+        size_t j = i;
+        for(; j > 0 && (*list)[j - 1] > v; j--){
+            (*list)[j] = (*list)[j - 1];
+        }
+        (*list)[j] = v;
+    }
+    return count;
+}
+
+/**
+ * Open the room's log, creating it on first use
+ * @param  log      [description]
+ * @param  roomname [description]
+ * @return          0, -1 if the room has no usable log
+ */
+int chat_log_open(struct chat_log *log, const char *roomname)
+{
+    char path[400];
+    memset(log, 0, sizeof(*log));
+    log->seg_fd = log->idx_fd = -1;
+    snprintf(log->dir, sizeof(log->dir), "/tmp/chatroom-%s/.log", roomname);
+    mkdir(log->dir, 0777);
+    chmod(log->dir, 0777);
+
+    snprintf(path, sizeof(path), "%s/head", log->dir);
+    log->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if(log->lock_fd < 0){
+        return -1;
+    }
+    flock(log->lock_fd, LOCK_EX);
+    struct stat st;
+    if(fstat(log->lock_fd, &st) == 0 && st.st_size < (off_t)sizeof(struct chat_log_state)){
+        ftruncate(log->lock_fd, sizeof(struct chat_log_state));
+    }
+    log->state = mmap(NULL, sizeof(struct chat_log_state), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, log->lock_fd, 0);
+    if(log->state == MAP_FAILED){
+        flock(log->lock_fd, LOCK_UN);
+        close(log->lock_fd);
+        return -1;
+    }
+    if(log->state->magic != CHAT_LOG_MAGIC){
+        log->state->next_seq = 1;
+        log->state->segment = 1;
+        log->state->seg_size = 0;
+        log->state->last_indexed = (uint64_t)-1;
+        log->state->magic = CHAT_LOG_MAGIC;
+    }
+    flock(log->lock_fd, LOCK_UN);
+    return 0;
+}
+
+/**
+ * Drop the oldest segments while the log is over CHAT_LOG_MAX. Runs
+ * under the lock, right after a rotation.
+ * @param log [description]
+ */
+static void chat_log_compact(struct chat_log *log)
+{
+    uint64_t *segments;
+    size_t count = chat_log_segments(log, &segments);
+    off_t total = 0;
+    off_t *sizes = calloc(count ? count : 1, sizeof(off_t));
+    char path[400];
+
+    for(size_t i = 0; i < count; i++){
+        struct stat st;
+        chat_log_path(log, segments[i], "seg", path, sizeof(path));
+        if(stat(path, &st) == 0){
+            sizes[i] = st.st_size;
+            total += st.st_size;
+        }
+    }
+    for(size_t i = 0; i + 1 < count && total > CHAT_LOG_MAX; i++){
+        chat_log_path(log, segments[i], "seg", path, sizeof(path));
+        unlink(path);
+        chat_log_path(log, segments[i], "idx", path, sizeof(path));
+        unlink(path);
+        total -= sizes[i];
+    }
+    free(sizes);
+    free(segments);
+}
+
+/**
+ * Append a message. The whole record goes out in one writev, a sparse
+ * index entry is added every CHAT_INDEX_SPACING bytes and the segment is
+ * rotated once it is full. Durability is batched, see chat_log_sync.
+ * @param  log [description]
+ * @param  msg [description]
+ * @param  len [description]
+ * @return     0, -1 on failure
+ */
+int chat_log_append(struct chat_log *log, const char *msg, size_t len)
+{
+    struct chat_log_state *st = log->state;
+    char path[400];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    flock(log->lock_fd, LOCK_EX);
+    if(st->seg_size > 0 && st->seg_size + sizeof(struct chat_log_record) + len > CHAT_SEGMENT_MAX){
+        st->segment = st->next_seq;
+        st->seg_size = 0;
+        st->last_indexed = (uint64_t)-1;
+        chat_log_compact(log);
+    }
+    if(log->seg_fd < 0 || log->segment != st->segment){
+        // first append, or somebody else rotated
+        chat_log_sync(log);
+        if(log->seg_fd >= 0){
+            close(log->seg_fd);
+            close(log->idx_fd);
+        }
+        log->segment = st->segment;
+        chat_log_path(log, log->segment, "seg", path, sizeof(path));
+        log->seg_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        chat_log_path(log, log->segment, "idx", path, sizeof(path));
+        log->idx_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if(log->seg_fd < 0 || log->idx_fd < 0){
+            flock(log->lock_fd, LOCK_UN);
+            return -1;
+        }
+    }
+
+    struct chat_log_record rec = {len, 0, st->next_seq,
+                                  now.tv_sec * 1000000000LL + now.tv_nsec};
+    if(st->last_indexed == (uint64_t)-1 ||
+       st->seg_size - st->last_indexed >= CHAT_INDEX_SPACING){
+        struct chat_log_index entry = {rec.seq, rec.time, st->seg_size};
+        write(log->idx_fd, &entry, sizeof(entry));
+        st->last_indexed = st->seg_size;
+    }
+    struct iovec iov[2] = {{&rec, sizeof(rec)}, {(void *)msg, len}};
+    ssize_t n = writev(log->seg_fd, iov, 2);
+    if(n == (ssize_t)(sizeof(rec) + len)){
+        st->next_seq++;
+        st->seg_size += n;
+    }
+    flock(log->lock_fd, LOCK_UN);
+
+    if(++log->pending >= CHAT_SYNC_RECORDS){
+        chat_log_sync(log);
+    }
+    return n == (ssize_t)(sizeof(rec) + len) ? 0 : -1;
+}
+
+/**
+ * Make what we appended durable, one fdatasync per file per batch
+ * @param log [description]
+ */
+void chat_log_sync(struct chat_log *log)
+{
+    if(log->pending > 0 && log->seg_fd >= 0){
+        fdatasync(log->seg_fd);
+        fdatasync(log->idx_fd);
+    }
+    log->pending = 0;
+}
+
+void chat_log_close(struct chat_log *log)
+{
+    chat_log_sync(log);
+    if(log->seg_fd >= 0){
+        close(log->seg_fd);
+        close(log->idx_fd);
+    }
+    munmap(log->state, sizeof(struct chat_log_state));
+    close(log->lock_fd);
+}
+
+/**
+ * Map a whole file read-only
+ * @param  path [description]
+ * @param  size [description]
+ * @return      NULL if it is missing or empty
+ */
+static void *chat_log_map(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    void *map = NULL;
+    *size = 0;
+    if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0){
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED){
+            map = NULL;
+        }
+        else{
+            *size = st.st_size;
+        }
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+    return map;
+}
+
+/**
+ * Write out the last messages of the room, or those sent since a time.
+ * The segment and the offset to start from are found through the first
+ * index entries and a binary search of one index, only the records from
+ * there on are read.
+ * @param  log   [description]
+ * @param  last  number of messages, used when since is 0
+ * @param  since CLOCK_REALTIME ns
+ * @param  fd    [description]
+ * @return       messages written
+ */
+int chat_log_replay(struct chat_log *log, uint64_t last, int64_t since, int fd)
+{
+    uint64_t next = __atomic_load_n(&log->state->next_seq, __ATOMIC_ACQUIRE);
+    uint64_t from_seq = since != 0 ? 0 : next > last ? next - last : 0;
+    int64_t from_time = since;
+    uint64_t *segments;
+    size_t count = chat_log_segments(log, &segments);
+    char path[400];
+    int written = 0;
+
+    if(since == 0 && last == 0){
+        free(segments);
+        return 0;
+    }
+
+    // the segment to start in: the last one that begins before the target
+    size_t start = 0;
+    for(size_t i = count; i-- > 0;){
+        if(since == 0){
+            if(segments[i] <= from_seq){
+                start = i;
+                break;
+            }
+            continue;
+        }
+        struct chat_log_index first;
+        chat_log_path(log, segments[i], "idx", path, sizeof(path));
+        int ifd = open(path, O_RDONLY | O_CLOEXEC);
+        bool before = ifd >= 0 && pread(ifd, &first, sizeof(first), 0) == sizeof(first) &&
+                      first.time <= from_time;
+        if(ifd >= 0){
+            close(ifd);
+        }
+        if(before){
+            start = i;
+            break;
+        }
+    }
+
+    struct outbuf *out = malloc(sizeof(struct outbuf));
+    out->fd = fd;
+    out->queue = NULL;
+    out->len = 0;
+    for(size_t i = start; i < count; i++){
+        size_t seg_size, idx_size;
+        uint64_t offset = 0;
+        if(i == start){
+            chat_log_path(log, segments[i], "idx", path, sizeof(path));
+            struct chat_log_index *idx = chat_log_map(path, &idx_size);
+            size_t lo = 0, hi = idx_size / sizeof(struct chat_log_index);
+            // last entry at or before the target
+            while(lo < hi){
+                size_t mid = (lo + hi) / 2;
+                bool before = since != 0 ? idx[mid].time <= from_time :
+                                           idx[mid].seq <= from_seq;
+                if(before){
+                    lo = mid + 1;
+                }
+                else{
+                    hi = mid;
+                }
+            }
+            if(lo > 0){
+                offset = idx[lo - 1].offset;
+            }
+            if(idx != NULL){
+                munmap(idx, idx_size);
+            }
+        }
+
+        chat_log_path(log, segments[i], "seg", path, sizeof(path));
+        char *seg = chat_log_map(path, &seg_size);
+        while(seg != NULL && offset + sizeof(struct chat_log_record) <= seg_size){
+            struct chat_log_record rec;
+            memcpy(&rec, seg + offset, sizeof(rec));
+            if(offset + sizeof(rec) + rec.len > seg_size){
+                break; // still being written
+            }
+            if(rec.seq >= from_seq && rec.time >= from_time){
+                out_write(out, seg + offset + sizeof(rec), rec.len);
+                written++;
+            }
+            offset += sizeof(rec) + rec.len;
+        }
+        if(seg != NULL){
+            munmap(seg, seg_size);
+        }
+    }
+    out_flush(out);
+    free(out);
+    free(segments);
+    return written;
+}
+
+/**
+ * bench chatlog [messages]
+ * Append messages to a scratch room's log with the usual sync batching,
+ * then replay the last 100 of them and everything after the midpoint
+ * @param  messages [description]
+ * @return          [description]
+ */
+int bench_chatlog(int messages)
+{
+    char roomname[64], path[400];
+    struct chat_log log;
+    snprintf(roomname, sizeof(roomname), "bench-log-%d", getpid());
+    snprintf(path, sizeof(path), "/tmp/chatroom-%s", roomname);
+    mkdir(path, 0777);
+    if(chat_log_open(&log, roomname) < 0){
+        perror(path);
+        return SUCCESS;
+    }
+
+    char msg[128];
+    int64_t middle = 0;
+    double start = now_seconds();
+    for(int i = 0; i < messages; i++){
+        int len = snprintf(msg, sizeof(msg), "[%s] bench : message number %d of the load test\n",
+                           roomname, i);
+        chat_log_append(&log, msg, len);
+        if(i == messages / 2){
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            middle = now.tv_sec * 1000000000LL + now.tv_nsec;
+        }
+    }
+    chat_log_sync(&log);
+    double elapsed = now_seconds() - start;
+    uint64_t *segments;
+    size_t count = chat_log_segments(&log, &segments);
+    char config[64];
+    snprintf(config, sizeof(config), "messages=%d", messages);
+    bench_result("chatlog", config, "append", messages / elapsed, "messages/s");
+    bench_result("chatlog", config, "segments", count, "segments");
+
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    start = now_seconds();
+    int n = chat_log_replay(&log, 100, 0, devnull);
+    bench_result("chatlog", config, "replay_last_100", (now_seconds() - start) * 1e6, "us");
+    start = now_seconds();
+    n = chat_log_replay(&log, 0, middle, devnull);
+    bench_result("chatlog", config, "replay_half", (now_seconds() - start) * 1e3, "ms");
+    bench_result("chatlog", config, "replay_half_messages", n, "messages");
+    close(devnull);
+
+    free(segments);
+    count = chat_log_segments(&log, &segments);
+    for(size_t i = 0; i < count; i++){
+        chat_log_path(&log, segments[i], "seg", path, sizeof(path));
+        unlink(path);
+        chat_log_path(&log, segments[i], "idx", path, sizeof(path));
+        unlink(path);
+    }
+    free(segments);
+    snprintf(path, sizeof(path), "%s/head", log.dir);
+    unlink(path);
+    chat_log_close(&log);
+    rmdir(log.dir);
+    snprintf(path, sizeof(path), "/tmp/chatroom-%s", roomname);
+    rmdir(path);
+    return SUCCESS;
+}
+
+/**
+ * Receiving side of the shared memory transport, prints every message
+ * from the ring, ours included
+ * @param  arg the room's chat_shm
+ * @return     [description]
+ */
+void *chat_shm_receiver(void *arg)
+{
+    struct chat_shm *r = arg;
+    char msg[CHAT_MESSAGE_MAX];
+    uint64_t lost = 0;
+
+    while(1){
+        ssize_t len = chat_shm_read(r, msg, sizeof(msg), -1);
+        if(r->lost != lost){
+            fprintf(stderr, "-- missed %lu messages --\n", (unsigned long)(r->lost - lost));
+            lost = r->lost;
+        }
+        if(len > 0){
+            write(STDOUT_FILENO, msg, len);
+        }
+    }
+    return NULL;
+}
+
+static volatile sig_atomic_t chat_quit;
+
+static void chat_quit_handler(int sig)
+{
+    (void)sig;
+    chat_quit = 1;
+}
+
+/**
+ * chatroom [-s] <room> <user>: one epoll loop over the terminal, our FIFO
+ * and the room's inotify watch. With -s messages go through the room's
+ * shared memory ring instead of a FIFO per member.
+ * @param arg_count [description]
+ * @param args      [description]
+ */
+void chat(int arg_count, char **args){
+    struct chat_room room;
+    struct chat_shm shm;
+    struct chat_log log;
+    bool use_shm = false;
+    uint64_t replay = 20; // -n, messages shown to a joiner
+    int64_t since = 0;    // -t, replay from this unix time instead
+    int i = 1;
+
+    for(; args[i] != NULL && args[i][0] == '-'; i++){
+        if(strcmp(args[i], "-s") == 0){
+            use_shm = true;
+        }
+        else if(strcmp(args[i], "-n") == 0 && args[i + 1] != NULL){
+            replay = strtoull(args[++i], NULL, 10);
+        }
+        else if(strcmp(args[i], "-t") == 0 && args[i + 1] != NULL){
+            since = strtoll(args[++i], NULL, 10) * 1000000000LL;
+        }
+        else{
+            break;
+        }
+    }
+    char *roomname = args[i];
+    char *username = roomname ? args[i + 1] : NULL;
+
+    if(roomname == NULL || username == NULL || strchr(username, '/') != NULL ||
+       strchr(roomname, '/') != NULL || username[0] == '.'){
+        fprintf(stderr, "usage: chatroom [-s] [-n count | -t time] <room> <user>\n");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    // ^C, a hangup or kill leave the room like exit does, so the last
+    // member still unlinks the ring and removes its FIFO
+    struct sigaction sa;
+    sigset_t quit_sigs, old_sigs;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = chat_quit_handler;
+    sigemptyset(&sa.sa_mask);
+    sigemptyset(&quit_sigs);
+    int quit_list[] = {SIGINT, SIGTERM, SIGHUP};
+    for(int s = 0; s < 3; s++){
+        sigaction(quit_list[s], &sa, NULL); // no SA_RESTART, epoll_wait returns
+        sigaddset(&quit_sigs, quit_list[s]);
+    }
+    if(use_shm){
+        if(chat_shm_open(&shm, roomname) < 0){
+            exit(EXIT_FAILURE);
+        }
+        // from here on stdin is the only thing the loop below waits for
+        room.self_fd = room.inotify_fd = -1;
+    }
+    else if(chat_join(&room, roomname, username) < 0){
+        exit(EXIT_FAILURE);
+    }
+    bool logging = chat_log_open(&log, roomname) == 0;
+
+    printf("Welcome to %s\n", roomname);
+    fflush(stdout);
+    if(logging){
+        chat_log_replay(&log, since ? 0 : replay, since, STDOUT_FILENO);
+    }
+    if(use_shm){
+        pthread_t receiver;
+        // the signals must interrupt our epoll_wait, not the receiver
+        pthread_sigmask(SIG_BLOCK, &quit_sigs, &old_sigs);
+        pthread_create(&receiver, NULL, chat_shm_receiver, &shm);
+        pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int fds[3] = {STDIN_FILENO, room.self_fd, room.inotify_fd};
+    for(int i = 0; i < (use_shm ? 1 : 3); i++){
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = fds[i]};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+
+    char line[CHAT_MESSAGE_MAX];
+    size_t line_len = 0;
+    bool leaving = false;
+    while(!leaving){
+        struct epoll_event events[3];
+        // unsynced log records are flushed once the room goes quiet
+        int n = epoll_wait(epfd, events, 3, logging && log.pending ? 200 : -1);
+        if(chat_quit){
+            break;
+        }
+        if(n == 0){
+            chat_log_sync(&log);
+        }
+        for(int e = 0; e < n && !leaving; e++){
+            int fd = events[e].data.fd;
+            if(fd == room.inotify_fd){
+                chat_refresh(&room);
+            }
+            else if(fd == room.self_fd){
+                char buf[65536];
+                ssize_t got;
+                while((got = read(room.self_fd, buf, sizeof(buf))) > 0){
+                    write(STDOUT_FILENO, buf, got);
+                }
+            }
+            else{
+                ssize_t got = read(STDIN_FILENO, line + line_len, sizeof(line) - line_len);
+                if(got <= 0){
+                    leaving = true;
+                    break;
+                }
+                line_len += got;
+                char *nl;
+                while((nl = memchr(line, '\n', line_len)) != NULL || line_len == sizeof(line)){
+                    size_t len = nl ? (size_t)(nl - line) : line_len;
+                    if(len == 4 && memcmp(line, "exit", 4) == 0){
+                        leaving = true;
+                        break;
+                    }
+                    size_t used = nl ? len + 1 : len;
+                    if(len == 0){
+                        memmove(line, line + used, line_len - used);
+                        line_len -= used;
+                        continue;
+                    }
+                    char msg[CHAT_MESSAGE_MAX + 512];
+                    int mlen = snprintf(msg, sizeof(msg), "[%s] %s : %.*s\n",
+                                        roomname, username, (int)len, line);
+                    if(mlen > CHAT_MESSAGE_MAX){
+                        mlen = CHAT_MESSAGE_MAX;
+                        msg[mlen - 1] = '\n';
+                    }
+                    if(logging){
+                        chat_log_append(&log, msg, mlen);
+                    }
+                    if(use_shm){
+                        chat_shm_publish(&shm, msg, mlen); // we read it back too
+                    }
+                    else{
+                        write(STDOUT_FILENO, msg, mlen);
+                        chat_refresh(&room); // pick up anyone who just joined
+                        chat_send(&room, msg, mlen);
+                    }
+                    memmove(line, line + used, line_len - used);
+                    line_len -= used;
+                }
+            }
+        }
+    }
+    close(epfd);
+    if(logging){
+        chat_log_close(&log);
+    }
+    if(use_shm){
+        chat_shm_close(&shm); // the receiver goes with the process
+    }
+    else{
+        chat_leave(&room);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * bench chat [clients] [messages] [fifo|shm]
+ * Fork clients members into a scratch room and fan messages out to them
+ * through chat_send or the shared memory ring, each carrying its send
+ * time; every client reports the latency it saw
+ * @param  clients  [description]
+ * @param  messages [description]
+ * @param  shm      use the shared memory transport
+ * @return          [description]
+ */
+int bench_chat(int clients, int messages, bool shm)
+{
+    char roomname[64];
+    snprintf(roomname, sizeof(roomname), "bench-%d", getpid());
+    int ready[2], results[2];
+    pipe2(ready, O_CLOEXEC);
+    pipe2(results, O_CLOEXEC);
+
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    signal(SIGPIPE, SIG_IGN);
+
+    for(int i = 0; i < clients; i++){
+        if(fork() != 0){
+            continue;
+        }
+        struct chat_room room;
+        struct chat_shm ring;
+        char name[32];
+        snprintf(name, sizeof(name), "client-%d", i);
+        if(shm){
+            chat_shm_open(&ring, roomname);
+        }
+        else{
+            chat_join(&room, roomname, name);
+        }
+        write(ready[1], "r", 1);
+
+        // fixed size records: send time in ns
+        double sum = 0, max = 0;
+        int got = 0;
+        char buf[64 * 64];
+        size_t have = 0;
+        while(shm && got < messages){
+            if(chat_shm_read(&ring, buf, 64, 2000) != 64){
+                break;
+            }
+            double sent, now = now_seconds();
+            memcpy(&sent, buf, sizeof(sent));
+            sum += now - sent;
+            max = now - sent > max ? now - sent : max;
+            got++;
+        }
+        struct pollfd pfd = {shm ? -1 : room.self_fd, POLLIN, 0};
+        while(!shm && got < messages && poll(&pfd, 1, 2000) > 0){
+            ssize_t n = read(room.self_fd, buf + have, sizeof(buf) - have);
+            if(n <= 0){
+                continue;
+            }
+            have += n;
+            double now = now_seconds();
+            size_t records = have / 64;
+            for(size_t r = 0; r < records; r++){
+                double sent;
+                memcpy(&sent, buf + r * 64, sizeof(sent));
+                sum += now - sent;
+                max = now - sent > max ? now - sent : max;
+                got++;
+            }
+            memmove(buf, buf + records * 64, have - records * 64);
+            have -= records * 64;
+        }
+        double report[3] = {got, sum, max};
+        write(results[1], report, sizeof(report));
+        if(shm){
+            chat_shm_close(&ring);
+        }
+        else{
+            chat_leave(&room);
+        }
+        _exit(0);
+    }
+    close(ready[1]);
+    close(results[1]);
+    char c;
+    for(int i = 0; i < clients && read(ready[0], &c, 1) == 1; i++){
+    }
+
+    struct chat_room room;
+    struct chat_shm ring;
+    if(shm){
+        chat_shm_open(&ring, roomname);
+    }
+    else{
+        chat_join(&room, roomname, "sender");
+    }
+    double start = now_seconds();
+    size_t delivered = 0;
+    for(int m = 0; m < messages; m++){
+        char record[64] = {0};
+        double now = now_seconds();
+        memcpy(record, &now, sizeof(now));
+        if(shm){
+            chat_shm_publish(&ring, record, sizeof(record));
+            delivered += clients; // written once, there for everyone
+        }
+        else{
+            // a client whose FIFO is full misses it, as in a real room
+            delivered += chat_send(&room, record, sizeof(record));
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    double total = 0, sum = 0, max = 0, report[3];
+    for(int i = 0; i < clients && read(results[0], report, sizeof(report)) == sizeof(report); i++){
+        total += report[0];
+        sum += report[1];
+        max = report[2] > max ? report[2] : max;
+    }
+    while(waitpid(-1, NULL, 0) > 0){
+    }
+    if(shm){
+        chat_shm_close(&ring); // the clients are gone, this unlinks the ring
+    }
+    else{
+        chat_leave(&room);
+    }
+    char dir[128];
+    snprintf(dir, sizeof(dir), "/tmp/chatroom-%s", roomname);
+    rmdir(dir);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    close(ready[0]);
+    close(results[0]);
+
+    char config[64];
+    snprintf(config, sizeof(config), "%s clients=%d messages=%d", shm ? "shm" : "fifo",
+             clients, messages);
+    bench_result("chat", config, "deliveries", delivered / elapsed, "messages/s");
+    bench_result("chat", config, "received", total / ((double)clients * messages) * 100, "%");
+    bench_result("chat", config, "fanout_avg", total > 0 ? sum / total * 1e6 : 0, "us");
+    bench_result("chat", config, "fanout_max", max * 1e6, "us");
+    return SUCCESS;
+}
+
+
+
+void palindrome(int arg_count,char** args){
+    struct outbuf *out = malloc(sizeof(struct outbuf));
+    out->fd = STDOUT_FILENO;
+    out->queue = NULL;
+    out->len = 0;
+    fflush(stdout);
+    palindrome_stage(arg_count, args, NULL, out);
+    free(out);
+}
+
+int palindrome_stage(int arg_count, char **args, struct stage_input *in, struct outbuf *out){
+    int index=1;
+    int size= arg_count;
+    bool check= true;
+    int count =1;
+    char line[64];
+    while(index < size){
+        if(args[index]==NULL){
+            break;
+        }
+        check= true;
+        int head = 0;
+        int tail =strlen(args[index])-1;
+        while(tail>head){
+            if(args[index][head++] != args[index][tail--]){
+                check =false;
+            }
+        }
+        
+        if(check){
+            out_write(out, line, snprintf(line, sizeof(line), "%d. ", count));
+            out_write(out, args[index], strlen(args[index]));
+            out_write(out, "\n", 1);
+            count++;
+        }
+        index++;
+    }
+    if(count ==1){
+        const char *none = "There is no palindrome words in the arguments.";
+        out_write(out, none, strlen(none));
+    }
+    out_write(out, "\n", 1);
+    out_flush(out);
+    return 0;
+}
+
+
+void stage_queue_init(struct stage_queue *q)
+{
+    memset(q, 0, offsetof(struct stage_queue, lens)); // the chunks stay untouched
+}
+
+// let the other side know something changed, a syscall only if it sleeps
+static void stage_wake(uint32_t *wake, uint32_t *waits)
+{
+    __atomic_add_fetch(wake, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waits, __ATOMIC_SEQ_CST)){
+        futex(wake, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+}
+
+/**
+ * Sleep until ready() holds. The wake word is read before the check, so a
+ * change between the check and FUTEX_WAIT makes the wait return at once.
+ * @param q     [description]
+ * @param wake  [description]
+ * @param waits [description]
+ * @param ready [description]
+ */
+static void stage_wait(struct stage_queue *q, uint32_t *wake, uint32_t *waits,
+                       bool (*ready)(struct stage_queue *q))
+{
+    while(!ready(q)){
+        uint32_t seq = __atomic_load_n(wake, __ATOMIC_SEQ_CST);
+        __atomic_store_n(waits, 1, __ATOMIC_SEQ_CST);
+        if(!ready(q)){
+            futex(wake, FUTEX_WAIT_PRIVATE, seq, NULL);
+        }
+        __atomic_store_n(waits, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+static bool stage_readable(struct stage_queue *q)
+{
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != q->tail ||
+           __atomic_load_n(&q->writer_done, __ATOMIC_ACQUIRE);
+}
+
+// a writer that found the queue full sleeps until half of it is free, not
+// just one chunk, so the two threads don't take turns for every chunk
+static bool stage_writable(struct stage_queue *q)
+{
+    return q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) <= STAGE_CHUNKS / 2 ||
+           __atomic_load_n(&q->reader_done, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Copy data into the queue a chunk at a time, waiting for the reader
+ * whenever all chunks are taken
+ * @param  q    [description]
+ * @param  data [description]
+ * @param  len  [description]
+ * @return      len, -1 if the reader is gone
+ */
+ssize_t stage_queue_write(struct stage_queue *q, const char *data, size_t len)
+{
+    size_t done = 0;
+    while(done < len){
+        if(q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == STAGE_CHUNKS){
+            stage_wait(q, &q->writer_wake, &q->writer_waits, stage_writable);
+        }
+        if(__atomic_load_n(&q->reader_done, __ATOMIC_ACQUIRE)){
+            return -1;
+        }
+        size_t slot = q->head % STAGE_CHUNKS;
+        size_t n = len - done < OUTBUF_SIZE ? len - done : OUTBUF_SIZE;
+        memcpy(q->data[slot], data + done, n);
+        q->lens[slot] = n;
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+        stage_wake(&q->reader_wake, &q->reader_waits);
+        done += n;
+    }
+    return len;
+}
+
+void stage_queue_close_writer(struct stage_queue *q)
+{
+    __atomic_store_n(&q->writer_done, 1, __ATOMIC_SEQ_CST);
+    stage_wake(&q->reader_wake, &q->reader_waits);
+}
+
+void stage_queue_close_reader(struct stage_queue *q)
+{
+    __atomic_store_n(&q->reader_done, 1, __ATOMIC_SEQ_CST);
+    stage_wake(&q->writer_wake, &q->writer_waits);
+}
+
+/**
+ * read() for builtin stages, from the fd or the queue behind in
+ * @param  in  [description]
+ * @param  buf [description]
+ * @param  cap [description]
+ * @return     bytes read, 0 at the end of the input
+ */
+ssize_t stage_read(struct stage_input *in, char *buf, size_t cap)
+{
+    struct stage_queue *q = in->queue;
+    if(q == NULL){
+        return read(in->fd, buf, cap);
+    }
+    stage_wait(q, &q->reader_wake, &q->reader_waits, stage_readable);
+    if(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail){
+        return 0; // drained and the writer finished
+    }
+    size_t slot = q->tail % STAGE_CHUNKS;
+    size_t n = q->lens[slot] - in->offset;
+    n = n < cap ? n : cap;
+    memcpy(buf, q->data[slot] + in->offset, n);
+    in->offset += n;
+    if(in->offset == q->lens[slot]){
+        in->offset = 0;
+        __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - q->tail == STAGE_CHUNKS / 2){
+            stage_wake(&q->writer_wake, &q->writer_waits);
+        }
+    }
+    return n;
+}
+
+// builtins that only use their arguments, stdin and stdout, and so can run
+// as threads next to each other
+struct stage_builtin {
+    const char *name;
+    bool reads_input;
+    int (*run)(int arg_count, char **args, struct stage_input *in, struct outbuf *out);
+} stage_builtins[] = {
+    {"uniq", true, uniq_stage},
+    {"palindrome", false, palindrome_stage},
+};
+
+struct stage_builtin *stage_builtin_find(struct command_t *command)
+{
+    if(command->redirects[3] != NULL){
+        return NULL; // stderr is shared by every thread
+    }
+    for(size_t i = 0; i < sizeof(stage_builtins) / sizeof(stage_builtins[0]); i++){
+        if(strcmp(command->name, stage_builtins[i].name) == 0){
+            return &stage_builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * How many stages from command on can run as threads of one process
+ * @param  command [description]
+ * @param  timed   the job reports every stage, so each needs its own process
+ * @return         1 when it is not worth it
+ */
+int stage_group(struct command_t *command, bool timed)
+{
+    int count = 0;
+    if(timed || opt_timing){
+        return 1;
+    }
+    for(struct command_t *c = command; c != NULL && stage_builtin_find(c); c = c->next){
+        count++;
+    }
+    return opt_threads && count > 1 ? count : 1;
+}
+
+/**
+ * Can the whole pipeline run inside the shell without a fork: builtins
+ * only, in the foreground and untimed. The shell ignores SIGINT, so
+ * reading a terminal must still happen in a child that ^C can stop.
+ * @param  command [description]
+ * @return         [description]
+ */
+bool stage_inline(struct command_t *command)
+{
+    if(!opt_threads || command->background || command->timed || opt_timing){
+        return false;
+    }
+    for(struct command_t *c = command; c != NULL; c = c->next){
+        if(stage_builtin_find(c) == NULL){
+            return false;
+        }
+    }
+    return !stage_builtin_find(command)->reads_input ||
+           command->redirects[0] != NULL || !isatty(STDIN_FILENO);
+}
+
+// one builtin stage running as a thread
+struct stage_thread {
+    pthread_t thread;
+    struct command_t *command;
+    struct stage_builtin *builtin; // NULL if a redirection failed
+    struct stage_input in;
+    struct outbuf *out;
+    struct stage_queue *prev, *next;
+    int status;
+};
+
+void *stage_thread_main(void *arg)
+{
+    struct stage_thread *t = arg;
+    struct command_t *c = t->command;
+
+    t->status = t->builtin ? t->builtin->run(c->arg_count, c->args, &t->in, t->out) : 1;
+    out_flush(t->out);
+    // EOF for the next stage, a broken pipe for the one before
+    if(t->next != NULL){
+        stage_queue_close_writer(t->next);
+    }
+    if(t->prev != NULL){
+        stage_queue_close_reader(t->prev);
+    }
+    return NULL;
+}
+
+/**
+ * Run count builtin stages from first on as threads of this process,
+ * joined by stage queues instead of pipes. Only the ends and the stages'
+ * own redirections use file descriptors.
+ * @param  first [description]
+ * @param  count [description]
+ * @param  in    what the first stage reads
+ * @param  out   where the last stage writes
+ * @return       exit status of the last stage
+ */
+int stage_pipeline(struct command_t *first, int count, int in, int out)
+{
+    // one allocation, so it stays a single arena block that is reused
+    char *mem = arena_alloc(&stage_arena, (count - 1) * sizeof(struct stage_queue) +
+                            count * (sizeof(struct outbuf) + sizeof(struct stage_thread)));
+    struct stage_queue *queues = (struct stage_queue *)mem;
+    struct outbuf *outs = (struct outbuf *)(queues + count - 1);
+    struct stage_thread *threads = (struct stage_thread *)(outs + count);
+    struct command_t *c = first;
+
+    memset(threads, 0, count * sizeof(struct stage_thread));
+    for(int i = 0; i < count; i++, c = c->next){
+        struct stage_thread *t = &threads[i];
+        t->command = c;
+        t->builtin = stage_builtin_find(c);
+        t->prev = i > 0 ? threads[i - 1].next : NULL;
+        t->next = NULL;
+        if(i < count - 1){
+            t->next = &queues[i];
+            stage_queue_init(t->next);
+        }
+        t->in.fd = in;
+        t->in.queue = t->prev;
+        t->out = &outs[i];
+        t->out->fd = out;
+        t->out->queue = t->next;
+        t->out->len = 0;
+
+        // a redirection takes the place of the queue, like dup2 would
+        char *target = c->redirects[1] ? c->redirects[1] : c->redirects[2];
+        if(c->redirects[0] != NULL){
+            t->in.fd = open(c->redirects[0], O_RDONLY | O_CLOEXEC);
+            t->in.queue = NULL;
+        }
+        if(target != NULL){
+            int append = c->redirects[1] ? O_TRUNC : O_APPEND;
+            t->out->fd = open(target, O_WRONLY | O_CREAT | O_CLOEXEC | append, 0644);
+            t->out->queue = NULL;
+        }
+        if(t->in.fd < 0 || t->out->fd < 0){
+            fprintf(stderr, "-%s: %s: %s\n", sysname,
+                    t->in.fd < 0 ? c->redirects[0] : target, strerror(errno));
+            t->builtin = NULL;
+        }
+    }
+    for(int i = 0; i < count; i++){
+        pthread_create(&threads[i].thread, NULL, stage_thread_main, &threads[i]);
+    }
+
+    int status = 0;
+    c = first;
+    for(int i = 0; i < count; i++, c = c->next){
+        struct stage_thread *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        if(c->redirects[0] != NULL && t->in.fd >= 0){
+            close(t->in.fd);
+        }
+        if((c->redirects[1] != NULL || c->redirects[2] != NULL) && t->out->fd >= 0){
+            close(t->out->fd);
+        }
+        status = t->status;
+    }
+    arena_reset(&stage_arena);
+    return status;
+}
+
+
+/**
+ * Copy everything from in to out starting at both fds' current positions.
+ * Data stays in the kernel: copy_file_range first (reflinks/server-side
+ * copies where the filesystem supports it), then sendfile, then splice
+ * through a pipe. Plain read/write is only used when none of those apply,
+ * e.g. between two terminals.
+ * @param  in  [description]
+ * @param  out [description]
+ * @return     bytes copied, -1 on error
+ */
+off_t copy_data(int in, int out)
+{
+    const size_t chunk = 1 << 30;
+    off_t total = 0;
+    ssize_t n;
+
+    // when one side already is a pipe (a pipeline stage) splice moves the
+    // pages straight across, no intermediate pipe and no user space copy
+    struct stat in_st, out_st;
+    if(fstat(in, &in_st) == 0 && fstat(out, &out_st) == 0 &&
+       (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))){
+        while((n = splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE)) > 0){
+            total += n;
+        }
+        if(n == 0){
+            return total;
+        }
+        if(errno != EINVAL){
+            return -1;
+        }
+    }
+
+    // each stage falls through to the next one when the kernel refuses
+    // this pair of fds, positions are shared so a partial copy just continues
+    while((n = copy_file_range(in, NULL, out, NULL, chunk, 0)) > 0){
+        total += n;
+    }
+    if(n == 0){
+        return total;
+    }
+    if(errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+       errno != EOPNOTSUPP && errno != EBADF){
+        return -1;
+    }
+
+    while((n = sendfile(out, in, NULL, chunk)) > 0){
+        total += n;
+    }
+    if(n == 0){
+        return total;
+    }
+    if(errno != EINVAL && errno != ENOSYS){
+        return -1;
+    }
+
+    int p[2];
+    if(pipe(p) == 0){
+        while((n = splice(in, NULL, p[1], NULL, chunk, SPLICE_F_MOVE)) > 0){
+            ssize_t left = n;
+            while(left > 0){
+                ssize_t m = splice(p[0], NULL, out, NULL, left, SPLICE_F_MOVE);
+                if(m <= 0){
+                    close(p[0]);
+                    close(p[1]);
+                    return -1;
+                }
+                left -= m;
+            }
+            total += n;
+        }
+        close(p[0]);
+        close(p[1]);
+        if(n == 0){
+            return total;
+        }
+        if(errno != EINVAL && errno != ENOSYS){
+            return -1;
+        }
+    }
+
+    char *buffer = malloc(1 << 20);
+    while((n = read(in, buffer, 1 << 20)) > 0){
+        ssize_t done = 0;
+        while(done < n){
+            ssize_t m = write(out, buffer + done, n - done);
+            if(m < 0){
+                free(buffer);
+                return -1;
+            }
+            done += m;
+        }
+        total += n;
+    }
+    free(buffer);
+    return n < 0 ? -1 : total;
+}
+
+/**
+ * Copy a file that is not split into ranges (pipes, devices), keeping its
+ * permission bits. The destination is preallocated so the filesystem can
+ * lay it out in one extent.
+ * @param  src [description]
+ * @param  dst [description]
+ * @return     0 on success, -1 on error
+ */
+int mycp_single(char *src, char *dst){
+    struct stat st;
+    double start = now_seconds();
+
+    int in = strcmp(src, "-") == 0 ? dup(STDIN_FILENO) : open(src, O_RDONLY);
+    if(in < 0 || fstat(in, &st) < 0){
+        fprintf(stderr, "mycp: %s: %s\n", src, strerror(errno));
+        if(in >= 0){
+            close(in);
+        }
+        return -1;
+    }
+    if(S_ISDIR(st.st_mode)){
+        fprintf(stderr, "mycp: %s: Is a directory\n", src);
+        close(in);
+        return -1;
+    }
+    bool to_stdout = strcmp(dst, "-") == 0;
+    int out = to_stdout ? dup(STDOUT_FILENO) : open(dst, O_WRONLY|O_CREAT|O_TRUNC, st.st_mode & 07777);
+    if(out < 0){
+        fprintf(stderr, "mycp: %s: %s\n", dst, strerror(errno));
+        close(in);
+        return -1;
+    }
+    if(!to_stdout){
+        fchmod(out, st.st_mode & 07777); // open() only applies the mode on create, minus umask
+    }
+    if(!to_stdout && S_ISREG(st.st_mode) && st.st_size > 0){
+        // best effort, not every filesystem supports it
+        fallocate(out, 0, 0, st.st_size);
+    }
+
+    off_t copied = copy_data(in, out);
+    if(copied < 0){
+        fprintf(stderr, "mycp: %s -> %s: %s\n", src, dst, strerror(errno));
+    }
+    else if(!to_stdout && S_ISREG(st.st_mode) && copied < st.st_size){
+        ftruncate(out, copied); // source shrank while copying
+    }
+    close(in);
+    close(out);
+    if(copied < 0){
+        return -1;
+    }
+
+    double elapsed = now_seconds() - start;
+    fprintf(stderr, "mycp: %lld bytes in %.3f s (%.1f MB/s)\n", (long long)copied,
+            elapsed, elapsed > 0 ? copied / elapsed / 1e6 : 0.0);
+    return 0;
+}
+
+/**
+ * Copy len bytes at offset from in to the same offset in out without
+ * touching either fd's position, so several workers can fill one file.
+ * @param  in     [description]
+ * @param  out    [description]
+ * @param  offset [description]
+ * @param  len    [description]
+ * @return        bytes copied, -1 on error
+ */
+off_t copy_range(int in, int out, off_t offset, off_t len)
+{
+    loff_t in_off = offset, out_off = offset;
+    off_t total = 0;
+    ssize_t n = 0;
+
+    while(total < len && (n = copy_file_range(in, &in_off, out, &out_off, len - total, 0)) > 0){
+        total += n;
+    }
+    if(total == len || n == 0){
+        return total;
+    }
+    if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP){
+        return -1;
+    }
+
+    size_t bufsize = 1 << 20;
+    char *buffer = malloc(bufsize);
+    while(total < len){
+        size_t want = len - total < (off_t)bufsize ? (size_t)(len - total) : bufsize;
+        n = pread(in, buffer, want, offset + total);
+        if(n <= 0){
+            break;
+        }
+        ssize_t done = 0;
+        while(done < n){
+            ssize_t m = pwrite(out, buffer + done, n - done, offset + total + done);
+            if(m < 0){
+                free(buffer);
+                return -1;
+            }
+            done += m;
+        }
+        total += n;
+    }
+    free(buffer);
+    return n < 0 ? -1 : total;
+}
+
+/**
+ * Create dst like src and queue its byte ranges, recursing into
+ * directories when recursive is set
+ * @param  plan      [description]
+ * @param  src       [description]
+ * @param  dst       [description]
+ * @param  recursive [description]
+ * @return           0 on success, -1 on error
+ */
+int mycp_plan(struct copy_plan *plan, char *src, char *dst, bool recursive)
+{
+    struct stat st, dst_st;
+
+    if(stat(src, &st) < 0){
+        fprintf(stderr, "mycp: %s: %s\n", src, strerror(errno));
+        return -1;
+    }
+    if(stat(dst, &dst_st) == 0 && st.st_dev == dst_st.st_dev && st.st_ino == dst_st.st_ino){
+        fprintf(stderr, "mycp: %s and %s are the same file\n", src, dst);
+        return -1;
+    }
+
+    if(S_ISDIR(st.st_mode)){
+        if(!recursive){
+            fprintf(stderr, "mycp: -r not specified; omitting directory '%s'\n", src);
+            return -1;
+        }
+        if(mkdir(dst, st.st_mode & 07777) < 0 && errno != EEXIST){
+            fprintf(stderr, "mycp: %s: %s\n", dst, strerror(errno));
+            return -1;
+        }
+        DIR *dir = opendir(src);
+        if(dir == NULL){
+            fprintf(stderr, "mycp: %s: %s\n", src, strerror(errno));
+            return -1;
+        }
+        int r = 0;
+        struct dirent *entry;
+        while((entry = readdir(dir)) != NULL){
+            if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0){
+                continue;
+            }
+            char *s = malloc(strlen(src) + strlen(entry->d_name) + 2);
+            char *d = malloc(strlen(dst) + strlen(entry->d_name) + 2);
+            sprintf(s, "%s/%s", src, entry->d_name);
+            sprintf(d, "%s/%s", dst, entry->d_name);
+            if(mycp_plan(plan, s, d, recursive) < 0){
+                r = -1;
+            }
+            free(s);
+            free(d);
+        }
+        closedir(dir);
+        return r;
+    }
+
+    if(!S_ISREG(st.st_mode)){
+        // no size to split on, stream it right away
+        return mycp_single(src, dst);
+    }
+
+    // create and size the destination now so workers only need pwrite access
+    int out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, st.st_mode & 07777);
+    if(out < 0){
+        fprintf(stderr, "mycp: %s: %s\n", dst, strerror(errno));
+        return -1;
+    }
+    fchmod(out, st.st_mode & 07777);
+    if(st.st_size > 0 && fallocate(out, 0, 0, st.st_size) < 0){
+        ftruncate(out, st.st_size);
+    }
+    close(out);
+
+    if(plan->nfiles == plan->files_cap){
+        plan->files_cap = plan->files_cap ? plan->files_cap * 2 : 16;
+        plan->files = realloc(plan->files, plan->files_cap * sizeof(struct copy_file));
+    }
+    struct copy_file *f = &plan->files[plan->nfiles++];
+    f->src = strdup(src);
+    f->dst = strdup(dst);
+    f->size = st.st_size;
+
+    off_t chunk = st.st_size > MYCP_CHUNK_THRESHOLD ? MYCP_CHUNK_SIZE : st.st_size;
+    off_t offset = 0;
+    do{
+        if(plan->ntasks == plan->tasks_cap){
+            plan->tasks_cap = plan->tasks_cap ? plan->tasks_cap * 2 : 16;
+            plan->tasks = realloc(plan->tasks, plan->tasks_cap * sizeof(struct copy_task));
+        }
+        struct copy_task *t = &plan->tasks[plan->ntasks++];
+        t->file = plan->nfiles - 1;
+        t->offset = offset;
+        t->len = st.st_size - offset < chunk ? st.st_size - offset : chunk;
+        offset += t->len;
+    }while(offset < st.st_size);
+    return 0;
+}
+
+void *mycp_worker(void *arg)
+{
+    struct copy_plan *plan = arg;
+    size_t i;
+
+    while((i = __atomic_fetch_add(&plan->next, 1, __ATOMIC_RELAXED)) < plan->ntasks){
+        struct copy_task *t = &plan->tasks[i];
+        struct copy_file *f = &plan->files[t->file];
+        int in = open(f->src, O_RDONLY);
+        int out = open(f->dst, O_WRONLY);
+        off_t n = -1;
+        if(in >= 0 && out >= 0){
+            n = copy_range(in, out, t->offset, t->len);
+        }
+        if(n < 0){
+            fprintf(stderr, "mycp: %s -> %s: %s\n", f->src, f->dst, strerror(errno));
+            __atomic_add_fetch(&plan->errors, 1, __ATOMIC_RELAXED);
+        }
+        else{
+            __atomic_add_fetch(&plan->bytes, n, __ATOMIC_RELAXED);
+        }
+        if(in >= 0){
+            close(in);
+        }
+        if(out >= 0){
+            close(out);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * mycp [-r] [-j N] src dst
+ * mycp [-r] [-j N] src... dir
+ * mycp - dst, mycp src -   copy from stdin / to stdout
+ * Files are copied by a pool of N worker threads (default: online CPUs),
+ * files larger than MYCP_CHUNK_THRESHOLD are split into ranges so one big
+ * file is also spread over the pool.
+ * @param  arg_count [description]
+ * @param  args      [description]
+ * @return           0 on success, -1 if anything failed
+ */
+int mycp(int arg_count, char **args)
+{
+    bool recursive = false;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *paths[arg_count];
+    int npaths = 0;
+
+    for(int i = 1; i < arg_count && args[i] != NULL; i++){
+        if(strcmp(args[i], "-r") == 0 || strcmp(args[i], "-R") == 0){
+            recursive = true;
+        }
+        else if(strcmp(args[i], "-j") == 0 && args[i+1] != NULL){
+            jobs = atoi(args[++i]);
+        }
+        else{
+            paths[npaths++] = args[i];
+        }
+    }
+    if(npaths < 2){
+        fprintf(stderr, "usage: mycp [-r] [-j N] src... dst\n");
+        return -1;
+    }
+    if(npaths == 2 && (strcmp(paths[0], "-") == 0 || strcmp(paths[1], "-") == 0)){
+        // a pipeline stage, the pipe end is spliced from/to directly
+        return mycp_single(paths[0], paths[1]);
+    }
+    if(jobs < 1){
+        jobs = 1;
+    }
+
+    struct copy_plan plan;
+    memset(&plan, 0, sizeof(plan));
+    char *target = paths[npaths - 1];
+    struct stat st;
+    bool into_dir = stat(target, &st) == 0 && S_ISDIR(st.st_mode);
+    if(npaths > 2 && !into_dir){
+        fprintf(stderr, "mycp: target '%s' is not a directory\n", target);
+        return -1;
+    }
+
+    double start = now_seconds();
+    int r = 0;
+    for(int i = 0; i < npaths - 1; i++){
+        if(into_dir){
+            char *copy = strdup(paths[i]);
+            char *base = basename(copy);
+            char *dst = malloc(strlen(target) + strlen(base) + 2);
+            sprintf(dst, "%s/%s", target, base);
+            r |= mycp_plan(&plan, paths[i], dst, recursive);
+            free(dst);
+            free(copy);
+        }
+        else{
+            r |= mycp_plan(&plan, paths[i], target, recursive);
+        }
+    }
+
+    if(jobs > (int)plan.ntasks){
+        jobs = plan.ntasks;
+    }
+    pthread_t workers[jobs > 0 ? jobs : 1];
+    for(int i = 0; i < jobs; i++){
+        pthread_create(&workers[i], NULL, mycp_worker, &plan);
+    }
+    for(int i = 0; i < jobs; i++){
+        pthread_join(workers[i], NULL);
+    }
+
+    double elapsed = now_seconds() - start;
+    if(plan.nfiles > 0){
+        fprintf(stderr, "mycp: %zu files, %lld bytes in %.3f s (%.1f MB/s, %d workers)\n",
+                plan.nfiles, (long long)plan.bytes, elapsed,
+                elapsed > 0 ? plan.bytes / elapsed / 1e6 : 0.0, jobs);
+    }
+    for(size_t i = 0; i < plan.nfiles; i++){
+        free(plan.files[i].src);
+        free(plan.files[i].dst);
+    }
+    free(plan.files);
+    free(plan.tasks);
+    return r < 0 || plan.errors > 0 ? -1 : 0;
+}
+
+/**
+ * parallel [-j N] command [args] ::: input...
+ * parallel [-j N] command [args] < inputs
+ * Runs command once per input, with the input appended (or put in place
+ * of {}), keeping at most N instances running (default: online CPUs).
+ * A new instance starts as soon as one exits. Each instance writes to its
+ * own temporary file which is copied to stdout in one piece when it
+ * finishes, so output of different instances never interleaves.
+ * Runs in a forked builtin stage, so it reaps its children itself.
+ * @param  arg_count [description]
+ * @param  args      [description]
+ * @return           number of failed instances, at most 101
+ */
+int parallel(int arg_count, char **args)
+{
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+
+    if(args[first] != NULL && strcmp(args[first], "-j") == 0 && args[first+1] != NULL){
+        jobs = atoi(args[first+1]);
+        first += 2;
+    }
+    if(jobs < 1){
+        jobs = 1;
+    }
+    int ntemplate = 0;
+    while(args[first+ntemplate] != NULL && strcmp(args[first+ntemplate], ":::") != 0){
+        ntemplate++;
+    }
+    if(ntemplate == 0){
+        fprintf(stderr, "usage: parallel [-j N] command [args] [::: inputs...]\n");
+        return 1;
+    }
+
+    // inputs come after ::: or one per line on stdin
+    char **inputs;
+    size_t ninputs = 0;
+    if(args[first+ntemplate] != NULL){
+        inputs = &args[first+ntemplate+1];
+        while(inputs[ninputs] != NULL){
+            ninputs++;
+        }
+    }
+    else{
+        // read fd 0 directly, the stdio buffer may still hold the shell's input
+        size_t len = 0, cap = 64 * 1024;
+        char *data = malloc(cap);
+        ssize_t n;
+        while((n = read(STDIN_FILENO, data + len, cap - len - 1)) > 0){
+            len += n;
+            if(len + 1 == cap){
+                cap *= 2;
+                data = realloc(data, cap);
+            }
+        }
+        data[len] = 0;
+        size_t count = 0;
+        for(size_t i = 0; i < len; i++){
+            count += data[i] == '\n';
+        }
+        inputs = malloc((count + 1) * sizeof(char *));
+        for(char *line = data; line < data + len; ){
+            char *nl = strchr(line, '\n');
+            if(nl != NULL){
+                *nl = 0;
+            }
+            inputs[ninputs++] = line;
+            line = nl ? nl + 1 : data + len;
+        }
+    }
+
+    struct slot {
+        pid_t pid;
+        FILE *out;
+    } slots[jobs];
+    int running = 0, failed = 0;
+    size_t next = 0;
+    int devnull = open("/dev/null", O_RDONLY);
+    char *argv[ntemplate + 2];
+    struct command_t instance;
+    memset(&instance, 0, sizeof(instance));
+    instance.args = argv;
+    for(int i = 0; i < jobs; i++){
+        slots[i].pid = 0;
+    }
+
+    while(next < ninputs || running > 0){
+        // fill every free slot
+        for(int i = 0; i < jobs && next < ninputs; i++){
+            if(slots[i].pid != 0){
+                continue;
+            }
+            bool placed = false;
+            int n = 0;
+            for(int a = 0; a < ntemplate; a++){
+                if(strcmp(args[first+a], "{}") == 0){
+                    argv[n++] = inputs[next];
+                    placed = true;
+                }
+                else{
+                    argv[n++] = args[first+a];
+                }
+            }
+            if(!placed){
+                argv[n++] = inputs[next];
+            }
+            argv[n] = NULL;
+            instance.name = argv[0];
+            next++;
+
+            slots[i].out = tmpfile();
+            pid_t pid;
+            // instances share our process group, so the job's ^C/^Z reaches them
+            if(slots[i].out == NULL ||
+               launch_command(&instance, devnull, fileno(slots[i].out), NULL, 0, -1, false, &pid) != 0){
+                fprintf(stderr, "parallel: %s: command not found\n", instance.name);
+                if(slots[i].out != NULL){
+                    fclose(slots[i].out);
+                }
+                failed++;
+                continue;
+            }
+            slots[i].pid = pid;
+            running++;
+        }
+        if(running == 0){
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if(pid < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        for(int i = 0; i < jobs; i++){
+            if(slots[i].pid != pid){
+                continue;
+            }
+            int fd = fileno(slots[i].out);
+            lseek(fd, 0, SEEK_SET);
+            copy_data(fd, STDOUT_FILENO);
+            fclose(slots[i].out);
+            slots[i].pid = 0;
+            running--;
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+                failed++;
+            }
+        }
+    }
+    close(devnull);
+    return failed > 101 ? 101 : failed;
+}
+
+
+/**
+ * Set up a history ring and load the history file, if one is given, by
+ * mapping it. Loaded lines point into the mapping, nothing is copied.
+ * @param h        [description]
+ * @param path     history file or NULL
+ * @param capacity entries kept in memory
+ */
+void history_init(struct history *h, const char *path, size_t capacity)
+{
+    memset(h, 0, sizeof(*h));
+    h->capacity = capacity;
+    h->fd = -1;
+    if(path == NULL){
+        return;
+    }
+
+    h->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    if(h->fd < 0 || fstat(h->fd, &st) < 0 || st.st_size == 0){
+        return;
+    }
+    h->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, h->fd, 0);
+    if(h->map == MAP_FAILED){
+        h->map = NULL;
+        return;
+    }
+    h->map_len = st.st_size;
+    madvise(h->map, h->map_len, MADV_SEQUENTIAL);
+
+    char *p = h->map, *end = h->map + h->map_len;
+    struct line_scanner scan;
+    line_scanner_init(&scan, h->map, h->map_len);
+    while(p < end){
+        const char *nl = line_next(&scan);
+        size_t len = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        history_add(h, p, len, false);
+        p += len + 1;
+    }
+    if(h->first > 0){
+        history_trim(h, path);
+    }
+}
+
+/**
+ * Rewrite the history file with only the entries in memory, once it holds
+ * more than capacity lines. The new file replaces the old one by rename,
+ * loaded lines keep pointing into the old file's mapping.
+ * @param h    [description]
+ * @param path [description]
+ */
+void history_trim(struct history *h, const char *path)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0){
+        return;
+    }
+    bool ok = true;
+    for(size_t seq = h->first; seq < h->next && ok; seq++){
+        size_t len;
+        const char *line = history_get(h, seq, &len);
+        if(h->pending_len + len + 1 > sizeof(h->pending)){
+            ok = write(fd, h->pending, h->pending_len) == (ssize_t)h->pending_len;
+            h->pending_len = 0;
+        }
+        if(len + 1 > sizeof(h->pending)){
+            struct iovec iov[2] = {{(void *)line, len}, {"\n", 1}};
+            ok = ok && writev(fd, iov, 2) == (ssize_t)len + 1;
+            continue;
+        }
+        memcpy(h->pending + h->pending_len, line, len);
+        h->pending[h->pending_len + len] = '\n';
+        h->pending_len += len + 1;
+    }
+    if(ok && h->pending_len > 0){
+        ok = write(fd, h->pending, h->pending_len) == (ssize_t)h->pending_len;
+    }
+    h->pending_len = 0;
+    close(fd);
+    if(!ok || rename(tmp, path) < 0){
+        unlink(tmp);
+        return;
+    }
+    int newfd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if(newfd >= 0){
+        close(h->fd);
+        h->fd = newfd;
+    }
+}
+
+/**
+ * Append a line. Empty lines and repeats of the newest entry are skipped.
+ * @param h       [description]
+ * @param line    need not be NUL terminated
+ * @param len     [description]
+ * @param persist also queue it for the history file
+ */
+void history_add(struct history *h, const char *line, size_t len, bool persist)
+{
+    if(len == 0 || h->capacity == 0){
+        return;
+    }
+    if(h->next > h->first){
+        size_t last = (h->next - 1) % h->capacity;
+        if(h->lens[last] == len && memcmp(h->lines[last], line, len) == 0){
+            return;
+        }
+    }
+
+    size_t slot = h->next % h->capacity;
+    if(slot >= h->allocated){
+        // nothing was evicted yet, so seq == slot and growing is enough
+        size_t n = h->allocated ? h->allocated * 2 : 256;
+        if(n > h->capacity){
+            n = h->capacity;
+        }
+        h->lines = realloc(h->lines, n * sizeof(char *));
+        h->lens = realloc(h->lens, n * sizeof(uint32_t));
+        h->allocated = n;
+    }
+    if(h->next - h->first == h->capacity){
+        // evict the oldest, its postings are skipped by seq from now on
+        char *old = h->lines[slot];
+        if(old < h->map || old >= h->map + h->map_len){
+            free(old);
+        }
+        h->first++;
+    }
+    bool mapped = line >= h->map && line < h->map + h->map_len;
+    if(mapped){
+        h->lines[slot] = (char *)line;
+    }
+    else{
+        h->lines[slot] = malloc(len);
+        memcpy(h->lines[slot], line, len);
+    }
+    h->lens[slot] = len;
+    h->next++;
+
+    if(persist && h->fd >= 0){
+        if(h->pending_len + len + 1 > sizeof(h->pending)){
+            history_flush(h);
+        }
+        if(len + 1 > sizeof(h->pending)){
+            struct iovec iov[2] = {{(void *)line, len}, {"\n", 1}};
+            writev(h->fd, iov, 2);
+            return;
+        }
+        memcpy(h->pending + h->pending_len, line, len);
+        h->pending[h->pending_len + len] = '\n';
+        h->pending_len += len + 1;
+    }
+}
+
+/**
+ * @param  h   [description]
+ * @param  seq between h->first and h->next
+ * @param  len set to the length of the line, which is not NUL terminated
+ * @return     [description]
+ */
+const char *history_get(struct history *h, size_t seq, size_t *len)
+{
+    *len = h->lens[seq % h->capacity];
+    return h->lines[seq % h->capacity];
+}
+
+/**
+ * Write out queued lines with one write, O_APPEND keeps the lines of
+ * several shells from overwriting each other
+ * @param h [description]
+ */
+void history_flush(struct history *h)
+{
+    if(h->fd >= 0 && h->pending_len > 0){
+        write(h->fd, h->pending, h->pending_len);
+    }
+    h->pending_len = 0;
+}
+
+void history_free(struct history *h)
+{
+    history_flush(h);
+    for(size_t seq = h->first; seq < h->next; seq++){
+        char *line = h->lines[seq % h->capacity];
+        if(line < h->map || line >= h->map + h->map_len){
+            free(line);
+        }
+    }
+    if(h->postings != NULL){
+        for(int i = 0; i < HISTORY_BUCKETS; i++){
+            free(h->postings[i]);
+        }
+        free(h->postings);
+        free(h->post_len);
+        free(h->post_cap);
+    }
+    if(h->map != NULL){
+        munmap(h->map, h->map_len);
+    }
+    if(h->fd >= 0){
+        close(h->fd);
+    }
+    free(h->lines);
+    free(h->lens);
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+}
+
+static inline unsigned int trigram_bucket(const char *p)
+{
+    unsigned char a = p[0], b = p[1], c = p[2];
+    return ((a * 0x9E37u) ^ (b * 0x85EBu) ^ (c * 0xC2B2u) ^ (a << 5)) &
+           (HISTORY_BUCKETS - 1);
+}
+
+/**
+ * Bring the trigram index up to date. It is built on the first search and
+ * extended by whatever was added since, so startup never pays for it.
+ * @param h [description]
+ */
+void history_index(struct history *h)
+{
+    if(h->postings == NULL){
+        h->postings = calloc(HISTORY_BUCKETS, sizeof(uint32_t *));
+        h->post_len = calloc(HISTORY_BUCKETS, sizeof(uint32_t));
+        h->post_cap = calloc(HISTORY_BUCKETS, sizeof(uint32_t));
+    }
+    if(h->indexed < h->first){
+        h->indexed = h->first;
+    }
+    for(; h->indexed < h->next; h->indexed++){
+        size_t len;
+        const char *line = history_get(h, h->indexed, &len);
+        for(size_t i = 0; i + 3 <= len; i++){
+            unsigned int b = trigram_bucket(line + i);
+            uint32_t n = h->post_len[b];
+            if(n > 0 && h->postings[b][n - 1] == h->indexed){
+                continue; // a line counts once per bucket
+            }
+            if(n == h->post_cap[b]){
+                // drop evicted entries before growing
+                uint32_t stale = 0;
+                while(stale < n && h->postings[b][stale] < h->first){
+                    stale++;
+                }
+                if(stale > n / 2){
+                    memmove(h->postings[b], h->postings[b] + stale,
+                            (n - stale) * sizeof(uint32_t));
+                    n = h->post_len[b] = n - stale;
+                }
+                else{
+                    h->post_cap[b] = h->post_cap[b] ? h->post_cap[b] * 2 : 8;
+                    h->postings[b] = realloc(h->postings[b],
+                                             h->post_cap[b] * sizeof(uint32_t));
+                }
+            }
+            h->postings[b][n] = h->indexed;
+            h->post_len[b] = n + 1;
+        }
+    }
+}
+
+/**
+ * Newest entry older than before that contains query. Queries of three or
+ * more bytes only look at lines sharing the query's rarest trigram.
+ * @param  h      [description]
+ * @param  query  [description]
+ * @param  before [description]
+ * @return        seq of the match, -1 if there is none
+ */
+long history_search(struct history *h, const char *query, size_t before)
+{
+    size_t qlen = strlen(query);
+    if(before > h->next){
+        before = h->next;
+    }
+
+    if(qlen < 3){
+        for(size_t seq = before; seq-- > h->first;){
+            size_t len;
+            const char *line = history_get(h, seq, &len);
+            if(memmem(line, len, query, qlen) != NULL){
+                return seq;
+            }
+        }
+        return -1;
+    }
+
+    history_index(h);
+    unsigned int best = trigram_bucket(query);
+    for(size_t i = 1; i + 3 <= qlen; i++){
+        unsigned int b = trigram_bucket(query + i);
+        if(h->post_len[b] < h->post_len[best]){
+            best = b;
+        }
+    }
+
+    // binary search for the first posting at or after before, then walk back
+    uint32_t *post = h->postings[best];
+    size_t lo = 0, hi = h->post_len[best];
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        if(post[mid] < before){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    while(lo-- > 0 && post[lo] >= h->first){
+        size_t len;
+        const char *line = history_get(h, post[lo], &len);
+        if(memmem(line, len, query, qlen) != NULL){
+            return post[lo];
+        }
+    }
+    return -1;
+}
+
+/**
+ * history [n]: list the last n entries, all of them without n
+ * @param  command [description]
+ * @return         [description]
+ */
+int history_builtin(struct command_t *command)
+{
+    struct history *h = &shell_history;
+    size_t count = h->next - h->first;
+
+    if(command->args[1] != NULL){
+        long n = atol(command->args[1]);
+        if(n >= 0 && (size_t)n < count){
+            count = n;
+        }
+    }
+    for(size_t seq = h->next - count; seq < h->next; seq++){
+        size_t len;
+        const char *line = history_get(h, seq, &len);
+        printf("%5zu  %.*s\n", seq + 1, (int)len, line);
+    }
+    last_status = 0;
+    return SUCCESS;
+}
+
+
+// builtins offered by tab completion next to the programs in $PATH
+static const char *builtin_names[] = {
+    "bench", "bg", "cd", "chatroom", "exit", "fg", "hash", "history", "jobs",
+    "mycp", "palindrome", "parallel", "psvis", "pstop", "set", "time", "uniq",
+    "wait", NULL,
+};
+
+// what getdents64 fills in
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Listing of a directory, read with getdents64 in 32K batches the first
+ * time and again only after the directory's mtime changes
+ * @param  c    [description]
+ * @param  path [description]
+ * @return      NULL if it cannot be read
+ */
+struct dir_listing *dir_listing_get(struct completer *c, const char *path)
+{
+    struct stat st;
+    if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode)){
+        return NULL;
+    }
+    struct dir_listing *d;
+    for(d = c->dirs; d != NULL; d = d->next){
+        if(strcmp(d->path, path) == 0){
+            break;
+        }
+    }
+    if(d != NULL && d->mtime.tv_sec == st.st_mtim.tv_sec &&
+       d->mtime.tv_nsec == st.st_mtim.tv_nsec){
+        return d;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0){
+        return NULL;
+    }
+    if(d == NULL){
+        d = calloc(1, sizeof(*d));
+        d->path = strdup(path);
+        d->next = c->dirs;
+        c->dirs = d;
+    }
+    arena_reset(&d->arena);
+    d->count = 0;
+    d->mtime = st.st_mtim;
+
+    size_t cap = 0;
+    char buf[32 * 1024];
+    long n;
+    while((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0){
+        for(long off = 0; off < n;){
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(buf + off);
+            off += e->d_reclen;
+            if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0){
+                continue;
+            }
+            if(d->count == cap){
+                cap = cap ? cap * 2 : 64;
+                d->names = realloc(d->names, cap * sizeof(char *));
+            }
+            size_t len = strlen(e->d_name);
+            char *name = arena_alloc(&d->arena, len + 2);
+            name[0] = e->d_type;
+            memcpy(name + 1, e->d_name, len + 1);
+            d->names[d->count++] = name + 1;
+        }
+    }
+    close(fd);
+    qsort(d->names, d->count, sizeof(char *), compare_names);
+    return d;
+}
+
+void trie_insert(struct completer *c, const char *name)
+{
+    uint32_t node = 0;
+    for(const char *p = name; *p; p++){
+        uint32_t prev = 0, n = c->nodes[node].child;
+        while(n != 0 && c->nodes[n].c != *p){
+            prev = n;
+            n = c->nodes[n].sibling;
+        }
+        if(n == 0){
+            if(c->nnodes == c->cap){
+                c->cap *= 2;
+                c->nodes = realloc(c->nodes, c->cap * sizeof(struct trie_node));
+            }
+            n = c->nnodes++;
+            memset(&c->nodes[n], 0, sizeof(struct trie_node));
+            c->nodes[n].c = *p;
+            if(prev != 0){
+                c->nodes[prev].sibling = n;
+            }
+            else{
+                c->nodes[node].child = n;
+            }
+        }
+        node = n;
+    }
+    c->nodes[node].terminal = true;
+}
+
+/**
+ * Rebuild the command trie if $PATH or the mtime of one of its
+ * directories changed since the last build
+ * @param c [description]
+ */
+void trie_refresh(struct completer *c)
+{
+    const char *env = getenv("PATH");
+    if(env == NULL){
+        env = "";
+    }
+    size_t ndirs = 1;
+    for(const char *p = env; *p; p++){
+        ndirs += *p == ':';
+    }
+    struct timespec *mtimes = calloc(ndirs, sizeof(struct timespec));
+    char *path = strdup(env);
+    char *save, *dir = strtok_r(path, ":", &save);
+    for(size_t i = 0; dir != NULL; dir = strtok_r(NULL, ":", &save), i++){
+        struct stat st;
+        if(stat(dir, &st) == 0){
+            mtimes[i] = st.st_mtim;
+        }
+    }
+    free(path);
+
+    if(c->nodes != NULL && c->path_env != NULL && strcmp(c->path_env, env) == 0 &&
+       memcmp(c->mtimes, mtimes, ndirs * sizeof(struct timespec)) == 0){
+        free(mtimes);
+        return;
+    }
+
+    free(c->path_env);
+    free(c->mtimes);
+    c->path_env = strdup(env);
+    c->mtimes = mtimes;
+    c->ndirs = ndirs;
+    if(c->nodes == NULL){
+        c->cap = 1024;
+        c->nodes = malloc(c->cap * sizeof(struct trie_node));
+    }
+    c->nnodes = 1;
+    memset(&c->nodes[0], 0, sizeof(struct trie_node));
+
+    for(int i = 0; builtin_names[i] != NULL; i++){
+        trie_insert(c, builtin_names[i]);
+    }
+    path = strdup(env);
+    for(dir = strtok_r(path, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)){
+        struct dir_listing *d = dir_listing_get(c, dir);
+        int dfd = d ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        for(size_t i = 0; d != NULL && i < d->count; i++){
+            if(d->names[i][-1] == DT_DIR ||
+               faccessat(dfd, d->names[i], X_OK, 0) != 0){
+                continue;
+            }
+            trie_insert(c, d->names[i]);
+        }
+        if(dfd >= 0){
+            close(dfd);
+        }
+    }
+    free(path);
+}
+
+/**
+ * Collect the names under a trie node, at most max of them
+ * @param  c      [description]
+ * @param  node   [description]
+ * @param  prefix the name so far, extended in place
+ * @param  len    [description]
+ * @param  out    [description]
+ * @param  count  [description]
+ * @param  max    [description]
+ */
+void trie_collect(struct completer *c, uint32_t node, char *prefix, size_t len,
+                  char **out, size_t *count, size_t max)
+{
+    if(c->nodes[node].terminal && *count < max){
+        out[(*count)++] = strndup(prefix, len);
+    }
+    for(uint32_t n = c->nodes[node].child; n != 0 && *count < max && len < 255;
+        n = c->nodes[n].sibling){
+        prefix[len] = c->nodes[n].c;
+        trie_collect(c, n, prefix, len + 1, out, count, max);
+    }
+}
+
+// candidates for one completion, longest common prefix in common
+#define COMPLETE_MAX 256
+struct completion {
+    char *names[COMPLETE_MAX];
+    size_t count;
+    size_t total;    // candidates, also those not in names
+    char common[256];
+    bool is_dir;     // the single candidate is a directory
+};
+
+/**
+ * Complete a command name through the trie
+ * @param c      [description]
+ * @param prefix [description]
+ * @param out    [description]
+ */
+void complete_command(struct completer *c, const char *prefix,
+                      struct completion *out)
+{
+    trie_refresh(c);
+    uint32_t node = 0;
+    for(const char *p = prefix; *p; p++){
+        uint32_t n = c->nodes[node].child;
+        while(n != 0 && c->nodes[n].c != *p){
+            n = c->nodes[n].sibling;
+        }
+        if(n == 0){
+            return;
+        }
+        node = n;
+    }
+
+    // extend while there is exactly one way to go
+    size_t len = strlen(prefix);
+    if(len >= sizeof(out->common) - 1){
+        return;
+    }
+    memcpy(out->common, prefix, len);
+    while(!c->nodes[node].terminal && c->nodes[node].child != 0 &&
+          c->nodes[c->nodes[node].child].sibling == 0 &&
+          len < sizeof(out->common) - 1){
+        node = c->nodes[node].child;
+        out->common[len++] = c->nodes[node].c;
+    }
+    out->common[len] = 0;
+
+    char name[256];
+    memcpy(name, out->common, len);
+    trie_collect(c, node, name, len, out->names, &out->count, COMPLETE_MAX);
+    out->total = out->count;
+    if(out->count == COMPLETE_MAX){
+        out->total++; // there may be more, the listing says so
+    }
+}
+
+/**
+ * Complete a path from the cached listing of its directory
+ * @param c    [description]
+ * @param word [description]
+ * @param out  common is the completed last component
+ */
+void complete_path(struct completer *c, const char *word, struct completion *out)
+{
+    char dir[4096];
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+
+    if(slash == NULL){
+        strcpy(dir, ".");
+    }
+    else if(word[0] == '~' && word[1] == '/' && getenv("HOME") != NULL){
+        snprintf(dir, sizeof(dir), "%s%.*s", getenv("HOME"),
+                 (int)(slash - word), word + 1);
+    }
+    else{
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word + 1), word);
+    }
+    struct dir_listing *d = dir_listing_get(c, dir);
+    if(d == NULL){
+        return;
+    }
+
+    // the matches are one sorted range of the listing
+    size_t blen = strlen(base), lo = 0, hi = d->count;
+    while(lo < hi){
+        size_t mid = (lo + hi) / 2;
+        if(strcmp(d->names[mid], base) < 0){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    size_t first = SIZE_MAX;
+    for(size_t i = lo; i < d->count && strncmp(d->names[i], base, blen) == 0; i++){
+        if(d->names[i][0] == '.' && base[0] != '.'){
+            continue; // hidden unless asked for
+        }
+        if(first == SIZE_MAX){
+            first = i;
+            snprintf(out->common, sizeof(out->common), "%s", d->names[i]);
+        }
+        else{
+            size_t k = 0;
+            while(out->common[k] && out->common[k] == d->names[i][k]){
+                k++;
+            }
+            out->common[k] = 0;
+        }
+        if(out->count < COMPLETE_MAX){
+            out->names[out->count++] = strdup(d->names[i]);
+        }
+        out->total++;
+    }
+    if(out->total == 1){
+        unsigned char type = d->names[first][-1];
+        if(type == DT_LNK || type == DT_UNKNOWN){
+            char full[8192];
+            struct stat st;
+            snprintf(full, sizeof(full), "%s/%s", dir, d->names[first]);
+            type = stat(full, &st) == 0 && S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+        out->is_dir = type == DT_DIR;
+    }
+}
+
+/**
+ * Complete the word before the cursor: a command name in command position,
+ * a path anywhere else
+ * @param ed   [description]
+ * @param list print the candidates if nothing can be added
+ */
+void editor_complete(struct editor *ed, bool list)
+{
+    size_t start = ed->cursor;
+    while(start > 0 && !strchr(" \t|;&<>", ed->buf[start - 1])){
+        start--;
+    }
+    size_t before = start;
+    while(before > 0 && ed->buf[before - 1] == ' '){
+        before--;
+    }
+    bool command = before == 0 || strchr("|;&", ed->buf[before - 1]) != NULL;
+
+    char word[4096];
+    size_t wlen = ed->cursor - start;
+    memcpy(word, ed->buf + start, wlen);
+    word[wlen] = 0;
+
+    struct completion result;
+    result.count = result.total = 0;
+    result.common[0] = 0;
+    result.is_dir = false;
+    size_t have; // bytes of the word that common repeats
+    if(command && strchr(word, '/') == NULL){
+        complete_command(&shell_completer, word, &result);
+        have = wlen;
+    }
+    else{
+        complete_path(&shell_completer, word, &result);
+        const char *slash = strrchr(word, '/');
+        have = slash ? wlen - (slash + 1 - word) : wlen;
+    }
+
+    bool stuck = true;
+    size_t clen = strlen(result.common);
+    if(result.total > 0 && clen > have){
+        for(size_t i = have; i < clen; i++){
+            editor_insert(ed, result.common[i]);
+        }
+        stuck = false;
+    }
+    if(result.total == 1){
+        editor_insert(ed, result.is_dir ? '/' : ' ');
+        stuck = false;
+    }
+
+    if(stuck && list && result.total > 1){
+        // candidates under the line, then the prompt and line again
+        editor_move(ed, ed->shown_cursor, ed->shown_len);
+        editor_puts(ed, "\n", 1);
+        size_t col = 0;
+        for(size_t i = 0; i < result.count; i++){
+            size_t n = strlen(result.names[i]);
+            if(col > 0 && col + n + 2 > 80){
+                editor_puts(ed, "\n", 1);
+                col = 0;
+            }
+            editor_puts(ed, result.names[i], n);
+            editor_puts(ed, "  ", 2);
+            col += n + 2;
+        }
+        if(result.total > result.count){
+            editor_puts(ed, "\n...", 4);
+        }
+        editor_puts(ed, "\n", 1);
+        editor_flush(ed);
+        show_prompt();
+        fflush(stdout);
+        ed->shown_len = ed->shown_cursor = 0;
+    }
+    else if(stuck && result.total == 0){
+        editor_puts(ed, "\a", 1); // bell, like readline
+    }
+    for(size_t i = 0; i < result.count; i++){
+        free(result.names[i]);
+    }
+}
+
+/**
+ * bench complete [prefix]
+ * Time the trie build from $PATH and completions against the warm caches
+ * @param  prefix [description]
+ * @return        [description]
+ */
+int bench_complete(const char *prefix)
+{
+    struct completer *c = &shell_completer;
+    struct completion result;
+
+    free(c->path_env);
+    c->path_env = NULL; // force a rebuild
+    double start = now_seconds();
+    trie_refresh(c);
+    bench_result("complete", "PATH", "trie_build", (now_seconds() - start) * 1e3, "ms");
+    bench_result("complete", "PATH", "trie_nodes", c->nnodes, "nodes");
+
+    int rounds = 10000;
+    start = now_seconds();
+    for(int i = 0; i < rounds; i++){
+        result.count = result.total = 0;
+        complete_command(c, prefix, &result);
+        for(size_t k = 0; k < result.count; k++){
+            free(result.names[k]);
+        }
+    }
+    char config[64];
+    snprintf(config, sizeof(config), "command=%s candidates=%zu", prefix, result.total);
+    bench_result("complete", config, "lookup", (now_seconds() - start) * 1e6 / rounds, "us");
+
+    start = now_seconds();
+    for(int i = 0; i < rounds; i++){
+        result.count = result.total = 0;
+        complete_path(c, "/usr/bin/", &result);
+        for(size_t k = 0; k < result.count; k++){
+            free(result.names[k]);
+        }
+    }
+    snprintf(config, sizeof(config), "path=/usr/bin/ candidates=%zu", result.total);
+    bench_result("complete", config, "lookup", (now_seconds() - start) * 1e6 / rounds, "us");
+    return SUCCESS;
+}
+
+
+// a process as listed by the kernel module
+struct psvis_row {
+    int pid, ppid, depth;
+    char state;
+    unsigned long long start; // ns since boot
+    unsigned long rss;        // KB
+    char comm[64];
+};
+
+/**
+ * Read the tree the kernel module exports in one pass
+ * @param  fd   /proc/psvis, the root is whatever pid was written to it
+ * @param  rows set to a malloc'd array
+ * @return      number of rows, -1 with errno set if it can't be read
+ */
+long psvis_read_proc(int fd, struct psvis_row **rows)
+{
+    size_t len = 0, cap = 1 << 16;
+    char *buf = malloc(cap + 1);
+    ssize_t n;
+    while((n = read(fd, buf + len, cap - len)) > 0){
+        len += n;
+        if(len == cap){
+            buf = realloc(buf, (cap *= 2) + 1);
+        }
+    }
+    if(n < 0){
+        free(buf);
+        return -1;
+    }
+    buf[len] = 0;
+
+    long count = 0, max = 256;
+    *rows = malloc(max * sizeof(struct psvis_row));
+    for(char *line = buf, *next; line < buf + len; line = next){
+        next = strchr(line, '\n');
+        next = next ? next + 1 : buf + len;
+        struct psvis_row *r = &(*rows)[count];
+        if(line[0] == '#' || sscanf(line, "%d %d %d %c %llu %lu %63[^\n]", &r->pid,
+                                    &r->ppid, &r->depth, &r->state, &r->start,
+                                    &r->rss, r->comm) != 7){
+            continue;
+        }
+        if(++count == max){
+            *rows = realloc(*rows, (max *= 2) * sizeof(struct psvis_row));
+        }
+    }
+    free(buf);
+    return count;
+}
+
+/**
+ * Draw rows in depth-first order as a tree
+ * @param rows  [description]
+ * @param count [description]
+ */
+void psvis_render(struct psvis_row *rows, long count)
+{
+    int max_depth = 0;
+    for(long i = 0; i < count; i++){
+        max_depth = rows[i].depth > max_depth ? rows[i].depth : max_depth;
+    }
+    // last[i]: no later sibling, found by scanning backwards
+    bool *last = malloc(count + 1);
+    bool *follows = calloc(max_depth + 2, sizeof(bool));
+    for(long i = count; i-- > 0;){
+        int d = rows[i].depth;
+        last[i] = !follows[d];
+        follows[d] = true;
+        memset(follows + d + 1, 0, (max_depth - d + 1) * sizeof(bool));
+    }
+
+    struct outbuf *out = malloc(sizeof(struct outbuf));
+    out->fd = STDOUT_FILENO;
+    out->queue = NULL;
+    out->len = 0;
+    bool *open = follows; // reused: ancestors at each depth with siblings to come
+    char line[512];
+    for(long i = 0; i < count; i++){
+        int d = rows[i].depth;
+        for(int k = 1; k < d; k++){
+            out_write(out, open[k] ? "\u2502   " : "    ", open[k] ? 6 : 4);
+        }
+        if(d > 0){
+            out_write(out, last[i] ? "\u2514\u2500\u2500 " : "\u251c\u2500\u2500 ", 10);
+        }
+        open[d] = !last[i];
+        int n = snprintf(line, sizeof(line), "%s(%d) %c %luK\n", rows[i].comm,
+                         rows[i].pid, rows[i].state, rows[i].rss);
+        out_write(out, line, n);
+    }
+    out_flush(out);
+    free(out);
+    free(follows);
+    free(last);
+}
+
+/**
+ * Ask mymodule for processes through PSVIS_IOC_QUERY, growing the buffer
+ * and asking again while the answer doesn't fit
+ * @param  query pids or root and depth to look up
+ * @param  procs set to a malloc'd array
+ * @return       number of processes, -1 with errno set on failure
+ */
+long psvis_lookup(struct psvis_query *query, struct psvis_proc **procs)
+{
+    int fd = open(PSVIS_DEVICE, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return -1;
+    }
+    query->capacity = query->pids ? query->npids : 1024;
+    *procs = NULL;
+    while(1){
+        *procs = realloc(*procs, (query->capacity ? query->capacity : 1) * sizeof(struct psvis_proc));
+        query->procs = (uintptr_t)*procs;
+        if(ioctl(fd, PSVIS_IOC_QUERY, query) < 0){
+            int err = errno;
+            free(*procs);
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if(query->total <= query->capacity || query->capacity == PSVIS_QUERY_MAX){
+            break;
+        }
+        // the tree grew past the guess, ask again with some room to spare
+        query->capacity = query->total + query->total / 4;
+        if(query->capacity > PSVIS_QUERY_MAX){
+            query->capacity = PSVIS_QUERY_MAX;
+        }
+    }
+    close(fd);
+    return query->count;
+}
+
+/**
+ * The tree under root from the query ioctl, in the order /proc/psvis
+ * would list it
+ * @param  root  [description]
+ * @param  depth levels below root, -1 for all
+ * @param  rows  set to a malloc'd array
+ * @return       number of rows, -1 with errno set on failure
+ */
+long psvis_read_ioctl(int root, int depth, struct psvis_row **rows)
+{
+    struct psvis_query query = {.root = root, .depth = depth};
+    struct psvis_proc *procs;
+    long count = psvis_lookup(&query, &procs);
+    if(count < 0){
+        return -1;
+    }
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    *rows = malloc((count ? count : 1) * sizeof(struct psvis_row));
+    for(long i = 0; i < count; i++){
+        struct psvis_row *r = &(*rows)[i];
+        r->pid = procs[i].pid;
+        r->ppid = procs[i].ppid;
+        r->depth = procs[i].depth;
+        r->state = procs[i].state;
+        r->start = procs[i].start_ns;
+        r->rss = procs[i].rss_pages * page_kb;
+        snprintf(r->comm, sizeof(r->comm), "%.*s", PSVIS_COMM_LEN, procs[i].comm);
+    }
+    free(procs);
+    return count;
+}
+
+/**
+ * Tree through /proc/psvis, for modules without the query ioctl
+ * @param  root  [description]
+ * @param  depth levels below root, -1 for all
+ * @param  rows  set to a malloc'd array
+ * @return       number of rows, -1 with errno set on failure
+ */
+long psvis_read_tree(const char *root, int depth, struct psvis_row **rows)
+{
+    // the root is set per open file, so read back through the same one
+    int fd = open("/proc/psvis", O_RDWR | O_CLOEXEC);
+    long count = -1;
+    if(fd >= 0 && write(fd, root, strlen(root)) >= 0){
+        count = psvis_read_proc(fd, rows);
+    }
+    if(fd >= 0){
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    if(count > 0 && depth >= 0){
+        long kept = 0;
+        for(long i = 0; i < count; i++){
+            if((*rows)[i].depth <= depth){
+                (*rows)[kept++] = (*rows)[i];
+            }
+        }
+        count = kept;
+    }
+    return count;
+}
+
+/**
+ * psvis -p pid...: one line per process, all looked up in a single ioctl
+ * @param  pids  [description]
+ * @param  count [description]
+ * @return       exit status, 1 if any pid wasn't found
+ */
+int psvis_pids(char **pids, int count)
+{
+    struct psvis_query query = {0};
+    int32_t *wanted = malloc((count ? count : 1) * sizeof(int32_t));
+    for(int i = 0; i < count; i++){
+        wanted[i] = atoi(pids[i]);
+    }
+    query.pids = (uintptr_t)wanted;
+    query.npids = count;
+    struct psvis_proc *procs;
+    long found = psvis_lookup(&query, &procs);
+    free(wanted);
+    if(found < 0){
+        fprintf(stderr, "psvis: %s: %s (is mymodule loaded?)\n", PSVIS_DEVICE, strerror(errno));
+        return 1;
+    }
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    printf("%7s %7s S %9s %9s %9s COMMAND\n", "PID", "PPID", "USER", "SYS", "RSS");
+    for(long i = 0; i < found; i++){
+        struct psvis_proc *p = &procs[i];
+        printf("%7d %7d %c %9.2f %9.2f %8lluK %.*s\n", p->pid, p->ppid, p->state,
+               p->utime_ns / 1e9, p->stime_ns / 1e9,
+               (unsigned long long)p->rss_pages * page_kb, PSVIS_COMM_LEN, p->comm);
+    }
+    free(procs);
+    return found == count ? 0 : 1;
+}
+
+/**
+ * psvis [-d depth] [pid] or psvis -p pid...: the process tree under pid,
+ * 1 by default, or just the given processes, as reported by mymodule.
+ * Uses the query ioctl on PSVIS_DEVICE, /proc/psvis when there is none.
+ * @param  arg_count [description]
+ * @param  args      [description]
+ * @return           exit status
+ */
+int psvis(int arg_count, char **args)
+{
+    int depth = -1, i = 1;
+    for(; args[i] && args[i][0] == '-'; i++){
+        if(strcmp(args[i], "-p") == 0){
+            int count = 0;
+            while(args[i + 1 + count]){
+                count++;
+            }
+            return psvis_pids(args + i + 1, count);
+        }
+        else if(strcmp(args[i], "-d") == 0 && args[i + 1]){
+            depth = atoi(args[++i]);
+        }
+        else{
+            fprintf(stderr, "usage: psvis [-d depth] [pid] | psvis -p pid...\n");
+            return 2;
+        }
+    }
+    const char *root = args[i] ? args[i] : "1";
+
+    struct psvis_row *rows;
+    long count = psvis_read_ioctl(atoi(root), depth, &rows);
+    if(count < 0 && errno != ESRCH){
+        count = psvis_read_tree(root, depth, &rows);
+    }
+    if(count < 0){
+        fprintf(stderr, "psvis: %s: %s (is mymodule loaded?)\n", root, strerror(errno));
+        return 1;
+    }
+    psvis_render(rows, count);
+    free(rows);
+    return 0;
+}
+
+
+// one process of a pstop frame
+struct pstop_row {
+    struct psvis_sample sample;
+    double cpu; // percent of one CPU since the previous frame
+};
+
+static int pstop_by_pid(const void *a, const void *b)
+{
+    const struct pstop_row *x = a, *y = b;
+    return (x->sample.pid > y->sample.pid) - (x->sample.pid < y->sample.pid);
+}
+
+static int pstop_by_usage(const void *a, const void *b)
+{
+    const struct pstop_row *x = a, *y = b;
+    if(x->cpu != y->cpu){
+        return x->cpu < y->cpu ? 1 : -1;
+    }
+    return (x->sample.rss_pages < y->sample.rss_pages) -
+           (x->sample.rss_pages > y->sample.rss_pages);
+}
+
+/**
+ * Copy the newest complete pass out of the sampler ring. Records whose
+ * pass doesn't match were overwritten while we copied, then we go again.
+ * @param  hdr   [description]
+ * @param  rows  grown as needed
+ * @param  cap   [description]
+ * @param  pass  set to the pass that was copied
+ * @param  time  set to when it was taken
+ * @return       number of rows, 0 if there is no pass yet
+ */
+size_t pstop_snapshot(struct psvis_ring_header *hdr, struct pstop_row **rows,
+                      size_t *cap, uint64_t *pass, uint64_t *time)
+{
+    const struct psvis_sample *records =
+        (const struct psvis_sample *)((char *)hdr + hdr->data_offset);
+
+    while(1){
+        *pass = __atomic_load_n(&hdr->pass, __ATOMIC_ACQUIRE);
+        if(*pass == 0){
+            return 0;
+        }
+        uint64_t start = __atomic_load_n(&hdr->pass_start, __ATOMIC_RELAXED);
+        uint64_t count = __atomic_load_n(&hdr->pass_count, __ATOMIC_RELAXED);
+        *time = __atomic_load_n(&hdr->pass_time_ns, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&hdr->pass, __ATOMIC_ACQUIRE) != *pass){
+            continue; // a pass finished while we read the header
+        }
+        if(count > *cap){
+            *cap = count;
+            *rows = realloc(*rows, count * sizeof(struct pstop_row));
+        }
+        bool torn = false;
+        for(uint64_t i = 0; i < count && !torn; i++){
+            (*rows)[i].sample = records[(start + i) % hdr->capacity];
+            torn = (*rows)[i].sample.pass != *pass;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(!torn){
+            return count;
+        }
+    }
+}
+
+/**
+ * pstop [-d seconds] [-n frames]: live per-process CPU and memory view
+ * drawn from mymodule's sampler ring, which is mapped once instead of
+ * reading /proc/<pid>/stat for every process on every refresh
+ * @param  arg_count [description]
+ * @param  args      [description]
+ * @return           exit status
+ */
+int pstop(int arg_count, char **args)
+{
+    double delay = 0;
+    long frames = 0; // 0 until q
+    for(int i = 1; args[i] != NULL; i++){
+        if(strcmp(args[i], "-d") == 0 && args[i + 1] != NULL){
+            delay = atof(args[++i]);
+        }
+        else if(strcmp(args[i], "-n") == 0 && args[i + 1] != NULL){
+            frames = atol(args[++i]);
+        }
+        else{
+            fprintf(stderr, "usage: pstop [-d seconds] [-n frames]\n");
+            return 2;
+        }
+    }
+
+    int fd = open(PSVIS_DEVICE, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        fprintf(stderr, "pstop: %s: %s (is mymodule loaded?)\n", PSVIS_DEVICE, strerror(errno));
+        return 1;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    struct psvis_ring_header *hdr = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if(hdr == MAP_FAILED || hdr->magic != PSVIS_RING_MAGIC ||
+       hdr->record_size != sizeof(struct psvis_sample)){
+        fprintf(stderr, "pstop: %s: not a psvis sampler ring\n", PSVIS_DEVICE);
+        close(fd);
+        return 1;
+    }
+    size_t map_len = hdr->data_offset + (size_t)hdr->capacity * hdr->record_size;
+    munmap(hdr, page);
+    hdr = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(hdr == MAP_FAILED){
+        perror("pstop");
+        return 1;
+    }
+    if(hdr->interval_ms == 0){
+        fprintf(stderr, "pstop: the sampler is off, load mymodule with sample_ms=N\n");
+        munmap(hdr, map_len);
+        return 1;
+    }
+    int wait_ms = delay > 0 ? (int)(delay * 1000) : (int)hdr->interval_ms;
+
+    struct termios saved, raw;
+    bool tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    if(tty){
+        raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+    struct winsize ws;
+    int lines = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 4 ? ws.ws_row - 3 : 20;
+
+    struct pstop_row *cur = NULL, *prev = NULL;
+    size_t cur_cap = 0, prev_cap = 0, prev_count = 0;
+    uint64_t prev_pass = 0, prev_time = 0;
+    struct outbuf *out = malloc(sizeof(struct outbuf));
+    out->fd = STDOUT_FILENO;
+    out->queue = NULL;
+    out->len = 0;
+    bool quit = false;
+
+    for(long frame = 0; !quit && (frames == 0 || frame < frames);){
+        uint64_t pass, time;
+        size_t count = pstop_snapshot(hdr, &cur, &cur_cap, &pass, &time);
+        if(count > 0 && pass != prev_pass){
+            double elapsed = prev_pass ? (time - prev_time) / 1e9 : 0;
+            for(size_t i = 0; i < count; i++){
+                struct pstop_row *old = prev_count == 0 ? NULL :
+                    bsearch(&cur[i], prev, prev_count, sizeof(struct pstop_row), pstop_by_pid);
+                uint64_t used = cur[i].sample.utime_ns + cur[i].sample.stime_ns;
+                uint64_t before = old ? old->sample.utime_ns + old->sample.stime_ns : used;
+                cur[i].cpu = elapsed > 0 && used >= before ? (used - before) / 1e9 / elapsed * 100 : 0;
+            }
+            qsort(cur, count, sizeof(struct pstop_row), pstop_by_usage);
+
+            char line[256];
+            int n = snprintf(line, sizeof(line), "\033[H\033[2Jpstop: %zu processes, pass %llu, every %u ms (q quits)\n"
+                             "%7s %s %6s %10s %s\n", count, (unsigned long long)pass,
+                             hdr->interval_ms, "PID", "S", "CPU%", "RSS", "COMMAND");
+            out_write(out, line, n);
+            for(size_t i = 0; i < count && (int)i < lines; i++){
+                struct psvis_sample *sm = &cur[i].sample;
+                n = snprintf(line, sizeof(line), "%7d %c %6.1f %9lluK %.16s\n", sm->pid,
+                             sm->state, cur[i].cpu,
+                             (unsigned long long)sm->rss_pages * (page / 1024), sm->comm);
+                out_write(out, line, n);
+            }
+            out_flush(out);
+            frame++;
+
+            // keep this frame, sorted by pid, for the next one's deltas
+            qsort(cur, count, sizeof(struct pstop_row), pstop_by_pid);
+            struct pstop_row *swap = prev;
+            size_t swap_cap = prev_cap;
+            prev = cur;
+            prev_cap = cur_cap;
+            prev_count = count;
+            cur = swap;
+            cur_cap = swap_cap;
+            prev_pass = pass;
+            prev_time = time;
+        }
+        if(frames != 0 && frame >= frames){
+            break;
+        }
+
+        struct pollfd pfd = {tty ? STDIN_FILENO : -1, POLLIN, 0}; // -1 only sleeps
+        if(poll(&pfd, 1, count > 0 && pass == prev_pass ? wait_ms : 50) > 0){
+            char c;
+            quit = read(STDIN_FILENO, &c, 1) <= 0 || c == 'q';
+        }
+    }
+
+    if(tty){
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+    free(out);
+    free(cur);
+    free(prev);
+    munmap(hdr, map_len);
+    return 0;
 }